@@ -13,6 +13,7 @@
 #include <cstring>
 #include <cmath>
 #include <algorithm>
+#include <queue>
 
 #include "GuillotineBinPack.h"
 
@@ -22,11 +23,13 @@ using namespace std;
 
 GuillotineBinPack::GuillotineBinPack()
 :binWidth(0),
-binHeight(0)
+binHeight(0),
+freeEdgeMerge(0)
 {
 }
 
 GuillotineBinPack::GuillotineBinPack(int width, int height)
+:freeEdgeMerge(0)
 {
 	Init(width, height);
 }
@@ -54,103 +57,238 @@ void GuillotineBinPack::Init(int width, int height)
 	freeRectangles.push_back(n);
 }
 
-void GuillotineBinPack::Insert(std::vector<RectSize> &rects, bool merge, 
+void GuillotineBinPack::Insert(std::vector<RectSize> &rects, bool rot, bool merge, 
 	FreeRectChoiceHeuristic rectChoice, GuillotineSplitHeuristic splitMethod)
 {
-	// Remember variables about the best packing choice we have made so far during the iteration process.
-	int bestFreeRect = 0;
-	int bestRect = 0;
-	bool bestFlipped = false;
+	std::vector<Rect> dst;
+	std::vector<int> order;
+	Insert(rects, dst, order, rot, merge, rectChoice, splitMethod);
+}
 
-	// Pack rectangles one at a time until we have cleared the rects array of all rectangles.
-	// rects will get destroyed in the process.
-	while(rects.size() > 0)
+/// The best fitting rectangle for one free rectangle, as queued up by the batch Insert.
+struct GuillotineFit
+{
+	int score;
+	int freeRect; ///< The id of the free rectangle. Ids go up in the order the free rectangles appear in the list.
+	int rect;
+	bool flipped;
+	int version; ///< Goes up every time the fit for the free rectangle is recomputed, to tell stale entries apart.
+};
+
+/// Orders the fits the same way a search over every free rectangle and every rectangle breaks ties: by score, then
+/// by the position of the free rectangle in the list, then by the position of the rectangle, upright before flipped.
+struct WorseGuillotineFit
+{
+	bool operator()(const GuillotineFit &a, const GuillotineFit &b) const
 	{
-		// Stores the penalty score of the best rectangle placement - bigger=worse, smaller=better.
-		int bestScore = std::numeric_limits<int>::max();
+		if (a.score != b.score)
+			return a.score > b.score;
+		if (a.freeRect != b.freeRect)
+			return a.freeRect > b.freeRect;
+		if (a.rect != b.rect)
+			return a.rect > b.rect;
+		return a.flipped && !b.flipped;
+	}
+};
 
+void GuillotineBinPack::Insert(std::vector<RectSize> &rects, std::vector<Rect> &dst, std::vector<int> &order, bool rot, bool merge, 
+	FreeRectChoiceHeuristic rectChoice, GuillotineSplitHeuristic splitMethod)
+{
+	dst.clear();
+	order.clear();
+
+	// Rather than rescanning every rectangle for every free rectangle after each placement, remember the best
+	// fitting rectangle for each free rectangle in a priority queue. A fit only has to be recomputed once its free
+	// rectangle changes, or once its rectangle gets packed somewhere else, in which case the new fit can only be
+	// worse, so the queue stays in order. Stale entries are skipped when they come up.
+	// Packed rectangles and used up free rectangles are left in their lists as tombstones rather than erased
+	// from the middle, and swept out once they make up half of the list, so that both lists stay in order.
+	std::vector<int> remaining;
+	for(size_t i = 0; i < rects.size(); ++i)
+		remaining.push_back((int)i);
+	std::vector<bool> packed(rects.size(), false);
+	size_t numPacked = 0;
+
+	std::vector<int> freeIds;
+	std::vector<int> freeVersions;
+	int nextFreeId = 0;
+	for(size_t i = 0; i < freeRectangles.size(); ++i)
+	{
+		freeIds.push_back(nextFreeId++);
+		freeVersions.push_back(0);
+	}
+	size_t numUsedFree = 0;
+
+	// Sweeps out the used up free rectangles, and moves firstNew along with the rectangle it points to.
+	auto sweepUsedFreeRects = [&](size_t &firstNew)
+	{
+		size_t numLeft = 0;
 		for(size_t i = 0; i < freeRectangles.size(); ++i)
 		{
-			for(size_t j = 0; j < rects.size(); ++j)
+			if (i == firstNew)
+				firstNew = numLeft;
+			if (freeVersions[i] < 0)
+				continue;
+			freeRectangles[numLeft] = freeRectangles[i];
+			freeIds[numLeft] = freeIds[i];
+			freeVersions[numLeft] = freeVersions[i];
+			++numLeft;
+		}
+		firstNew = min(firstNew, numLeft);
+		freeRectangles.resize(numLeft);
+		freeIds.resize(numLeft);
+		freeVersions.resize(numLeft);
+		numUsedFree = 0;
+	};
+
+	std::priority_queue<GuillotineFit, std::vector<GuillotineFit>, WorseGuillotineFit> fits;
+	auto findBestFit = [&](size_t index)
+	{
+		const Rect &freeRect = freeRectangles[index];
+		GuillotineFit best;
+		best.score = std::numeric_limits<int>::max();
+		best.freeRect = freeIds[index];
+		best.rect = -1;
+		best.flipped = false;
+		best.version = ++freeVersions[index];
+		for(size_t i = 0; i < remaining.size(); ++i)
+		{
+			if (remaining[i] < 0)
+				continue;
+			const RectSize &r = rects[remaining[i]];
+			// A perfect match beats anything, and the rectangles after this one can only tie with it.
+			if ((r.width == freeRect.width && r.height == freeRect.height) ||
+				(rot && r.height == freeRect.width && r.width == freeRect.height))
 			{
-				// If this rectangle is a perfect match, we pick it instantly.
-				if (rects[j].width == freeRectangles[i].width && rects[j].height == freeRectangles[i].height)
-				{
-					bestFreeRect = i;
-					bestRect = j;
-					bestFlipped = false;
-					bestScore = std::numeric_limits<int>::min();
-					i = freeRectangles.size(); // Force a jump out of the outer loop as well - we got an instant fit.
-					break;
-				}
-				// If flipping this rectangle is a perfect match, pick that then.
-				else if (rects[j].height == freeRectangles[i].width && rects[j].width == freeRectangles[i].height)
-				{
-					bestFreeRect = i;
-					bestRect = j;
-					bestFlipped = true;
-					bestScore = std::numeric_limits<int>::min();
-					i = freeRectangles.size(); // Force a jump out of the outer loop as well - we got an instant fit.
-					break;
-				}
-				// Try if we can fit the rectangle upright.
-				else if (rects[j].width <= freeRectangles[i].width && rects[j].height <= freeRectangles[i].height)
+				best.score = std::numeric_limits<int>::min();
+				best.rect = remaining[i];
+				best.flipped = r.width != freeRect.width || r.height != freeRect.height;
+				break;
+			}
+			if (r.width <= freeRect.width && r.height <= freeRect.height)
+			{
+				int score = ScoreByHeuristic(r.width, r.height, freeRect, rectChoice);
+				if (score < best.score)
 				{
-					int score = ScoreByHeuristic(rects[j].width, rects[j].height, freeRectangles[i], rectChoice);
-					if (score < bestScore)
-					{
-						bestFreeRect = i;
-						bestRect = j;
-						bestFlipped = false;
-						bestScore = score;
-					}
+					best.score = score;
+					best.rect = remaining[i];
+					best.flipped = false;
 				}
-				// If not, then perhaps flipping sideways will make it fit?
-				else if (rects[j].height <= freeRectangles[i].width && rects[j].width <= freeRectangles[i].height)
+			}
+			if (rot && r.height <= freeRect.width && r.width <= freeRect.height)
+			{
+				int score = ScoreByHeuristic(r.height, r.width, freeRect, rectChoice);
+				if (score < best.score)
 				{
-					int score = ScoreByHeuristic(rects[j].height, rects[j].width, freeRectangles[i], rectChoice);
-					if (score < bestScore)
-					{
-						bestFreeRect = i;
-						bestRect = j;
-						bestFlipped = true;
-						bestScore = score;
-					}
+					best.score = score;
+					best.rect = remaining[i];
+					best.flipped = true;
 				}
 			}
 		}
+		if (best.rect >= 0)
+			fits.push(best);
+	};
+	for(size_t i = 0; i < freeRectangles.size(); ++i)
+		findBestFit(i);
 
-		// If we didn't manage to find any rectangle to pack, abort.
-		if (bestScore == std::numeric_limits<int>::max())
-			return;
+	while(!fits.empty())
+	{
+		GuillotineFit fit = fits.top();
+		fits.pop();
+
+		// The free rectangle might have been used up or merged away since.
+		size_t bestFreeRect = std::lower_bound(freeIds.begin(), freeIds.end(), fit.freeRect) - freeIds.begin();
+		if (bestFreeRect == freeIds.size() || freeIds[bestFreeRect] != fit.freeRect || freeVersions[bestFreeRect] != fit.version)
+			continue;
+		if (packed[fit.rect])
+		{
+			findBestFit(bestFreeRect);
+			continue;
+		}
 
-		// Otherwise, we're good to go and do the actual packing.
 		Rect newNode;
 		newNode.x = freeRectangles[bestFreeRect].x;
 		newNode.y = freeRectangles[bestFreeRect].y;
-		newNode.width = rects[bestRect].width;
-		newNode.height = rects[bestRect].height;
+		newNode.width = rects[fit.rect].width;
+		newNode.height = rects[fit.rect].height;
 
-		if (bestFlipped)
+		if (fit.flipped)
 			std::swap(newNode.width, newNode.height);
 
 		// Remove the free space we lost in the bin.
+		size_t numFreeRects = freeRectangles.size();
 		SplitFreeRectByHeuristic(freeRectangles[bestFreeRect], newNode, splitMethod);
-		freeRectangles.erase(freeRectangles.begin() + bestFreeRect);
-
-		// Remove the rectangle we just packed from the input list.
-		rects.erase(rects.begin() + bestRect);
+		for(size_t i = numFreeRects; i < freeRectangles.size(); ++i)
+		{
+			freeIds.push_back(nextFreeId++);
+			freeVersions.push_back(0);
+		}
+		freeVersions[bestFreeRect] = -1;
+
+		// A packed rectangle is tombstoned as the complement of its index, so the remaining rectangles stay sorted
+		// by index and the packed one can be found by binary search.
+		packed[fit.rect] = true;
+		int &tombstone = *std::lower_bound(remaining.begin(), remaining.end(), fit.rect,
+			[](int a, int b) { return (a < 0 ? ~a : a) < b; });
+		tombstone = ~tombstone;
+		if (++numPacked * 2 > remaining.size())
+		{
+			remaining.erase(std::remove_if(remaining.begin(), remaining.end(), [](int i) { return i < 0; }), remaining.end());
+			numPacked = 0;
+		}
 
-		// Perform a Rectangle Merge step if desired.
+		// Perform a Rectangle Merge step if desired, and look for the best fits for the free rectangles that
+		// are new or changed.
+		size_t firstNew = numFreeRects;
 		if (merge)
-			MergeFreeList();
+		{
+			// Merged rectangles keep the place of the earlier one, so the new ones still come after the old ones.
+			// The used up free rectangle is dropped by the same sweep that drops the merged ones.
+			MergeFreeList(mergeRemap, mergeGrown, (int)bestFreeRect);
+			size_t numOld = firstNew;
+			size_t numLeft = 0;
+			for(size_t i = 0; i < mergeRemap.size(); ++i)
+			{
+				if (i == numOld)
+					firstNew = numLeft;
+				if (mergeRemap[i] >= 0)
+				{
+					freeIds[numLeft] = freeIds[i];
+					freeVersions[numLeft] = freeVersions[i];
+					++numLeft;
+				}
+			}
+			freeIds.resize(numLeft);
+			freeVersions.resize(numLeft);
+			firstNew = min(firstNew, numLeft);
+			for(size_t i = 0; i < firstNew; ++i)
+				if (mergeGrown[i])
+					findBestFit(i);
+		}
+		else if (++numUsedFree * 2 > freeRectangles.size())
+			sweepUsedFreeRects(firstNew);
+		for(size_t i = firstNew; i < freeRectangles.size(); ++i)
+			findBestFit(i);
 
 		// Remember the new used rectangle.
 		usedRectangles.push_back(newNode);
+		dst.push_back(newNode);
+		order.push_back(fit.rect);
 
 		// Check that we're really producing correct packings here.
 		debug_assert(disjointRects.Add(newNode) == true);
 	}
+
+	size_t end = freeRectangles.size();
+	sweepUsedFreeRects(end);
+
+	// Leave the rectangles that didn't fit, in their original order.
+	size_t numLeft = 0;
+	for(size_t i = 0; i < rects.size(); ++i)
+		if (!packed[i])
+			rects[numLeft++] = rects[i];
+	rects.resize(numLeft);
 }
 
 /// @return True if r fits inside freeRect (possibly rotated).
@@ -337,12 +475,12 @@ void GuillotineBinPack::InsertMaxFitting(std::vector<RectSize> &rects, std::vect
 }
 */
 
-Rect GuillotineBinPack::Insert(int width, int height, bool merge, FreeRectChoiceHeuristic rectChoice, 
+Rect GuillotineBinPack::Insert(int width, int height, bool rot, bool merge, FreeRectChoiceHeuristic rectChoice, 
 	GuillotineSplitHeuristic splitMethod)
 {
 	// Find where to put the new rectangle.
 	int freeNodeIndex = 0;
-	Rect newRect = FindPositionForNewNode(width, height, rectChoice, &freeNodeIndex);
+	Rect newRect = FindPositionForNewNode(width, height, rot, rectChoice, &freeNodeIndex);
 
 	// Abort if we didn't have enough space in the bin.
 	if (newRect.height == 0)
@@ -428,7 +566,7 @@ int GuillotineBinPack::ScoreWorstLongSideFit(int width, int height, const Rect &
 	return -ScoreBestLongSideFit(width, height, freeRect);
 }
 
-Rect GuillotineBinPack::FindPositionForNewNode(int width, int height, FreeRectChoiceHeuristic rectChoice, int *nodeIndex)
+Rect GuillotineBinPack::FindPositionForNewNode(int width, int height, bool rot, FreeRectChoiceHeuristic rectChoice, int *nodeIndex)
 {
 	Rect bestNode;
 	memset(&bestNode, 0, sizeof(Rect));
@@ -451,7 +589,7 @@ Rect GuillotineBinPack::FindPositionForNewNode(int width, int height, FreeRectCh
 			break;
 		}
 		// If this is a perfect fit sideways, choose it.
-		else if (height == freeRectangles[i].width && width == freeRectangles[i].height)
+		else if (rot && height == freeRectangles[i].width && width == freeRectangles[i].height)
 		{
 			bestNode.x = freeRectangles[i].x;
 			bestNode.y = freeRectangles[i].y;
@@ -463,7 +601,7 @@ Rect GuillotineBinPack::FindPositionForNewNode(int width, int height, FreeRectCh
 			break;
 		}
 		// Does the rectangle fit upright?
-		else if (width <= freeRectangles[i].width && height <= freeRectangles[i].height)
+		if (width <= freeRectangles[i].width && height <= freeRectangles[i].height)
 		{
 			int score = ScoreByHeuristic(width, height, freeRectangles[i], rectChoice);
 
@@ -479,7 +617,7 @@ Rect GuillotineBinPack::FindPositionForNewNode(int width, int height, FreeRectCh
 			}
 		}
 		// Does the rectangle fit sideways?
-		else if (height <= freeRectangles[i].width && width <= freeRectangles[i].height)
+		if (rot && height <= freeRectangles[i].width && width <= freeRectangles[i].height)
 		{
 			int score = ScoreByHeuristic(height, width, freeRectangles[i], rectChoice);
 
@@ -585,51 +723,82 @@ void GuillotineBinPack::SplitFreeRectAlongAxis(const Rect &freeRect, const Rect
 }
 
 void GuillotineBinPack::MergeFreeList()
+{
+	MergeFreeList(mergeRemap, mergeGrown);
+}
+
+void GuillotineBinPack::MergeFreeList(std::vector<int> &remap, std::vector<bool> &grown, int removed)
 {
 #ifdef _DEBUG
 	DisjointRectCollection test;
 	for(size_t i = 0; i < freeRectangles.size(); ++i)
-		assert(test.Add(freeRectangles[i]) == true);
+		if ((int)i != removed)
+			assert(test.Add(freeRectangles[i]) == true);
 #endif
 
-	// Do a Theta(n^2) loop to see if any pair of free rectangles could me merged into one.
-	// Note that we miss any opportunities to merge three rectangles into one. (should call this function again to detect that)
+	// Keep the table at most half full, so that the probe sequences stay short.
+	size_t tableSize = max(freeEdges.size(), (size_t)64);
+	while(tableSize < freeRectangles.size() * 8)
+		tableSize *= 2;
+	if (tableSize != freeEdges.size() || ++freeEdgeMerge == 0)
+	{
+		FreeEdgeSlot empty;
+		memset(&empty, 0, sizeof(FreeEdgeSlot));
+		freeEdges.assign(tableSize, empty);
+		freeEdgeMerge = 1;
+	}
+	for(size_t i = 0; i < freeRectangles.size(); ++i)
+		if ((int)i != removed)
+			AddFreeEdges((int)i);
+
+	// Merging two rectangles can make the result mergeable with a third one, so keep at it until the rectangle
+	// has no partner left. Every merge removes a rectangle, so this takes linear time overall.
+	remap.assign(freeRectangles.size(), 0);
+	grown.assign(freeRectangles.size(), false);
+	if (removed >= 0)
+		remap[removed] = -1;
 	for(size_t i = 0; i < freeRectangles.size(); ++i)
-		for(size_t j = i+1; j < freeRectangles.size(); ++j)
+	{
+		int index = (int)i;
+		int other;
+		while(remap[index] >= 0 && (other = FindMergeableFreeRect(index)) >= 0)
 		{
-			if (freeRectangles[i].width == freeRectangles[j].width && freeRectangles[i].x == freeRectangles[j].x)
-			{
-				if (freeRectangles[i].y == freeRectangles[j].y + freeRectangles[j].height)
-				{
-					freeRectangles[i].y -= freeRectangles[j].height;
-					freeRectangles[i].height += freeRectangles[j].height;
-					freeRectangles.erase(freeRectangles.begin() + j);
-					--j;
-				}
-				else if (freeRectangles[i].y + freeRectangles[i].height == freeRectangles[j].y)
-				{
-					freeRectangles[i].height += freeRectangles[j].height;
-					freeRectangles.erase(freeRectangles.begin() + j);
-					--j;
-				}
-			}
-			else if (freeRectangles[i].height == freeRectangles[j].height && freeRectangles[i].y == freeRectangles[j].y)
-			{
-				if (freeRectangles[i].x == freeRectangles[j].x + freeRectangles[j].width)
-				{
-					freeRectangles[i].x -= freeRectangles[j].width;
-					freeRectangles[i].width += freeRectangles[j].width;
-					freeRectangles.erase(freeRectangles.begin() + j);
-					--j;
-				}
-				else if (freeRectangles[i].x + freeRectangles[i].width == freeRectangles[j].x)
-				{
-					freeRectangles[i].width += freeRectangles[j].width;
-					freeRectangles.erase(freeRectangles.begin() + j);
-					--j;
-				}
-			}
+			int first = min(index, other);
+			int second = max(index, other);
+			RemoveFreeEdges(first);
+			RemoveFreeEdges(second);
+
+			Rect &a = freeRectangles[first];
+			const Rect &b = freeRectangles[second];
+			int x = min(a.x, b.x);
+			int y = min(a.y, b.y);
+			if (a.x == b.x)
+				a.height += b.height;
+			else
+				a.width += b.width;
+			a.x = x;
+			a.y = y;
+
+			AddFreeEdges(first);
+			remap[second] = -1;
+			grown[first] = true;
+			index = first;
 		}
+	}
+
+	// Sweep out the rectangles that were merged away, keeping the rest in order.
+	size_t numLeft = 0;
+	for(size_t i = 0; i < freeRectangles.size(); ++i)
+	{
+		if (remap[i] < 0)
+			continue;
+		remap[i] = (int)numLeft;
+		freeRectangles[numLeft] = freeRectangles[i];
+		grown[numLeft] = grown[i];
+		++numLeft;
+	}
+	freeRectangles.resize(numLeft);
+	grown.resize(numLeft);
 
 #ifdef _DEBUG
 	test.Clear();
@@ -638,4 +807,86 @@ void GuillotineBinPack::MergeFreeList()
 #endif
 }
 
+enum FreeEdgeSide
+{
+	EdgeTop,
+	EdgeBottom,
+	EdgeLeft,
+	EdgeRight
+};
+
+size_t GuillotineBinPack::FindFreeEdge(const FreeEdge &edge) const
+{
+	size_t hash = (size_t)edge.side;
+	hash = hash * 0x9E3779B1u + (size_t)edge.start;
+	hash = hash * 0x9E3779B1u + (size_t)edge.length;
+	hash = hash * 0x9E3779B1u + (size_t)edge.line;
+	hash ^= hash >> 15;
+	hash *= 0x2C1B3C6Du;
+	hash ^= hash >> 12;
+
+	// Erased slots have to be stepped over, since the edge may have been put further along before they were erased.
+	size_t mask = freeEdges.size() - 1;
+	for(size_t slot = hash & mask;; slot = (slot + 1) & mask)
+	{
+		const FreeEdgeSlot &entry = freeEdges[slot];
+		if (entry.merge != freeEdgeMerge || (entry.index >= 0 && entry.edge == edge))
+			return slot;
+	}
+}
+
+void GuillotineBinPack::AddFreeEdges(int index)
+{
+	const Rect &r = freeRectangles[index];
+	FreeEdge edges[] = {
+		{ EdgeTop, r.x, r.width, r.y },
+		{ EdgeBottom, r.x, r.width, r.y + r.height },
+		{ EdgeLeft, r.y, r.height, r.x },
+		{ EdgeRight, r.y, r.height, r.x + r.width }
+	};
+	for(size_t i = 0; i < 4; ++i)
+	{
+		FreeEdgeSlot &entry = freeEdges[FindFreeEdge(edges[i])];
+		entry.edge = edges[i];
+		entry.index = index;
+		entry.merge = freeEdgeMerge;
+	}
+}
+
+void GuillotineBinPack::RemoveFreeEdges(int index)
+{
+	const Rect &r = freeRectangles[index];
+	FreeEdge edges[] = {
+		{ EdgeTop, r.x, r.width, r.y },
+		{ EdgeBottom, r.x, r.width, r.y + r.height },
+		{ EdgeLeft, r.y, r.height, r.x },
+		{ EdgeRight, r.y, r.height, r.x + r.width }
+	};
+	for(size_t i = 0; i < 4; ++i)
+	{
+		FreeEdgeSlot &entry = freeEdges[FindFreeEdge(edges[i])];
+		if (entry.merge == freeEdgeMerge && entry.index == index)
+			entry.index = -1;
+	}
+}
+
+int GuillotineBinPack::FindMergeableFreeRect(int index) const
+{
+	// Look for a rectangle whose facing edge matches each edge of this one, the vertical neighbours first.
+	const Rect &r = freeRectangles[index];
+	FreeEdge partners[] = {
+		{ EdgeBottom, r.x, r.width, r.y },
+		{ EdgeTop, r.x, r.width, r.y + r.height },
+		{ EdgeRight, r.y, r.height, r.x },
+		{ EdgeLeft, r.y, r.height, r.x + r.width }
+	};
+	for(size_t i = 0; i < 4; ++i)
+	{
+		const FreeEdgeSlot &entry = freeEdges[FindFreeEdge(partners[i])];
+		if (entry.merge == freeEdgeMerge && entry.index >= 0 && entry.index != index)
+			return entry.index;
+	}
+	return -1;
+}
+
 }
@@ -52,21 +52,28 @@ public:
 		SplitLongerAxis ///< -LAS
 	};
 
-	/// Inserts a single rectangle into the bin. The packer might rotate the rectangle, in which case the returned
-	/// struct will have the width and height values swapped.
+	/// Inserts a single rectangle into the bin. If rot is true, the packer might rotate the rectangle, in which case
+	/// the returned struct will have the width and height values swapped.
 	/// @param merge If true, performs free Rectangle Merge procedure after packing the new rectangle. This procedure
 	///		tries to defragment the list of disjoint free rectangles to improve packing performance, but also takes up 
 	///		some extra time.
 	/// @param rectChoice The free rectangle choice heuristic rule to use.
 	/// @param splitMethod The free rectangle split heuristic rule to use.
-	Rect Insert(int width, int height, bool merge, FreeRectChoiceHeuristic rectChoice, GuillotineSplitHeuristic splitMethod);
+	Rect Insert(int width, int height, bool rot, bool merge, FreeRectChoiceHeuristic rectChoice, GuillotineSplitHeuristic splitMethod);
 
-	/// Inserts a list of rectangles into the bin.
+	/// Inserts a list of rectangles into the bin, possibly rotated.
 	/// @param rects The list of rectangles to add. This list will be destroyed in the packing process.
 	/// @param merge If true, performs Rectangle Merge operations during the packing process.
 	/// @param rectChoice The free rectangle choice heuristic rule to use.
 	/// @param splitMethod The free rectangle split heuristic rule to use.
-	void Insert(std::vector<RectSize> &rects, bool merge, 
+	void Insert(std::vector<RectSize> &rects, bool rot, bool merge, 
+		FreeRectChoiceHeuristic rectChoice, GuillotineSplitHeuristic splitMethod);
+
+	/// Inserts a list of rectangles into the bin, possibly rotated. At each step, the rectangle that fits best
+	/// into any of the free rectangles is placed. When packing stops, rects is left with the ones that didn't fit.
+	/// @param dst [out] This list will contain the packed rectangles, in the order they were packed.
+	/// @param order [out] For each entry in dst, the index in rects of the rectangle that was packed there.
+	void Insert(std::vector<RectSize> &rects, std::vector<Rect> &dst, std::vector<int> &order, bool rot, bool merge, 
 		FreeRectChoiceHeuristic rectChoice, GuillotineSplitHeuristic splitMethod);
 
 // Implements GUILLOTINE-MAXFITTING, an experimental heuristic that's really cool but didn't quite work in practice.
@@ -85,7 +92,8 @@ public:
 	std::vector<Rect> &GetUsedRectangles() { return usedRectangles; }
 
 	/// Performs a Rectangle Merge operation. This procedure looks for adjacent free rectangles and merges them if they
-	/// can be represented with a single rectangle. Takes up Theta(|freeRectangles|^2) time.
+	/// can be represented with a single rectangle, until no more merges are possible. The free rectangles are looked
+	/// up by their edges in a hash table, so this takes up Theta(|freeRectangles|) expected time.
 	void MergeFreeList();
 
 private:
@@ -99,6 +107,38 @@ private:
 	/// Stores a list of rectangles that represents the free area of the bin. This rectangles in this list are disjoint.
 	std::vector<Rect> freeRectangles;
 
+	/// Identifies one side of a free rectangle: which side it is, the position and length of the edge, and the
+	/// line it lies on. Two free rectangles can be merged when the bottom edge of one and the top edge of the other,
+	/// or the right edge of one and the left edge of the other, have the same position, length and line.
+	struct FreeEdge
+	{
+		int side;
+		int start;
+		int length;
+		int line;
+
+		bool operator==(const FreeEdge &other) const
+		{
+			return side == other.side && start == other.start && length == other.length && line == other.line;
+		}
+	};
+
+	/// An open addressing hash table of the free rectangles by their edges, used while merging. The table size is a
+	/// power of two, and each slot holds the index of the free rectangle, or -1 if it was erased. Slots filled in by
+	/// an earlier merge count as empty, so the table doesn't have to be cleared every time.
+	struct FreeEdgeSlot
+	{
+		FreeEdge edge;
+		int index;
+		unsigned int merge;
+	};
+	std::vector<FreeEdgeSlot> freeEdges;
+	unsigned int freeEdgeMerge;
+
+	/// Scratch space for MergeFreeList, kept around to avoid reallocating on every merge.
+	std::vector<int> mergeRemap;
+	std::vector<bool> mergeGrown;
+
 #ifdef _DEBUG
 	/// Used to track that the packer produces proper packings.
 	DisjointRectCollection disjointRects;
@@ -109,7 +149,7 @@ private:
 	/// @param nodeIndex [out] The index of the free rectangle in the freeRectangles array into which the new
 	///		rect was placed.
 	/// @return A Rect structure that represents the placement of the new rect into the best free rectangle.
-	Rect FindPositionForNewNode(int width, int height, FreeRectChoiceHeuristic rectChoice, int *nodeIndex);
+	Rect FindPositionForNewNode(int width, int height, bool rot, FreeRectChoiceHeuristic rectChoice, int *nodeIndex);
 
 	static int ScoreByHeuristic(int width, int height, const Rect &freeRect, FreeRectChoiceHeuristic rectChoice);
 	// The following functions compute (penalty) score values if a rect of the given size was placed into the 
@@ -129,6 +169,24 @@ private:
 
 	/// Splits the given L-shaped free rectangle into two new free rectangles along the given fixed split axis.
 	void SplitFreeRectAlongAxis(const Rect &freeRect, const Rect &placedRect, bool splitHorizontal);
+
+	/// Merges the free rectangles like MergeFreeList, keeping the ones that are left in order. A merged rectangle
+	/// takes the place of the earlier of the two.
+	/// @param remap [out] For each free rectangle before the merge, its index afterwards, or -1 if it was merged
+	///		into an earlier one or removed.
+	/// @param grown [out] For each free rectangle after the merge, whether it was made bigger.
+	/// @param removed The index of a used up free rectangle to drop from the list without merging it, or -1.
+	void MergeFreeList(std::vector<int> &remap, std::vector<bool> &grown, int removed = -1);
+
+	/// Adds the edges of the free rectangle at the given index to freeEdges, or removes them.
+	void AddFreeEdges(int index);
+	void RemoveFreeEdges(int index);
+
+	/// Returns the slot in freeEdges that holds the given edge, or the empty slot where it would go.
+	size_t FindFreeEdge(const FreeEdge &edge) const;
+
+	/// Returns the index of a free rectangle that can be merged with the one at the given index, or -1 if there is none.
+	int FindMergeableFreeRect(int index) const;
 };
 
 }
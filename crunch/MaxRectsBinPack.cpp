@@ -14,15 +14,214 @@
 #include <cmath>
 #include <algorithm>
 
+// The AVX2 loops get built on x86 whatever the compiler flags are, and only run on CPUs that support AVX2.
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define RBP_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define RBP_TARGET_AVX2
+#else
+#define RBP_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
 #include "MaxRectsBinPack.h"
 
 namespace rbp {
 
 using namespace std;
 
+#ifdef RBP_AVX2
+/// Checks once whether the CPU, and the OS, support AVX2.
+static bool HasAvx2()
+{
+#ifdef _MSC_VER
+	static const bool supported = [] {
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return false;
+		__cpuid(info, 1);
+		const int osxsave = 1 << 27;
+		const int avx = 1 << 28;
+		if ((info[2] & osxsave) == 0 || (info[2] & avx) == 0 || (_xgetbv(0) & 6) != 6)
+			return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+	}();
+#else
+	static const bool supported = __builtin_cpu_supports("avx2") != 0;
+#endif
+	return supported;
+}
+#endif
+
+/// Scoring policies for the FindPositionForNewNode search. Each one computes the primary and secondary penalty
+/// for placing a width x height rectangle into a free rectangle it fits in; smaller is better. The AVX2 versions
+/// score eight free rectangles at once.
+struct BestShortSideFitScore
+{
+	static void Score(int, int, int freeWidth, int freeHeight, int width, int height, int &score1, int &score2)
+	{
+		int leftoverHoriz = freeWidth - width;
+		int leftoverVert = freeHeight - height;
+		score1 = min(leftoverHoriz, leftoverVert);
+		score2 = max(leftoverHoriz, leftoverVert);
+	}
+#ifdef RBP_AVX2
+	RBP_TARGET_AVX2 static void Score(__m256i, __m256i, __m256i freeWidth, __m256i freeHeight, __m256i width, __m256i height, __m256i &score1, __m256i &score2)
+	{
+		__m256i leftoverHoriz = _mm256_sub_epi32(freeWidth, width);
+		__m256i leftoverVert = _mm256_sub_epi32(freeHeight, height);
+		score1 = _mm256_min_epi32(leftoverHoriz, leftoverVert);
+		score2 = _mm256_max_epi32(leftoverHoriz, leftoverVert);
+	}
+#endif
+};
+
+struct BestLongSideFitScore
+{
+	static void Score(int freeX, int freeY, int freeWidth, int freeHeight, int width, int height, int &score1, int &score2)
+	{
+		BestShortSideFitScore::Score(freeX, freeY, freeWidth, freeHeight, width, height, score2, score1);
+	}
+#ifdef RBP_AVX2
+	RBP_TARGET_AVX2 static void Score(__m256i freeX, __m256i freeY, __m256i freeWidth, __m256i freeHeight, __m256i width, __m256i height, __m256i &score1, __m256i &score2)
+	{
+		BestShortSideFitScore::Score(freeX, freeY, freeWidth, freeHeight, width, height, score2, score1);
+	}
+#endif
+};
+
+struct BestAreaFitScore
+{
+	static void Score(int, int, int freeWidth, int freeHeight, int width, int height, int &score1, int &score2)
+	{
+		score1 = freeWidth * freeHeight - width * height;
+		score2 = min(freeWidth - width, freeHeight - height);
+	}
+#ifdef RBP_AVX2
+	RBP_TARGET_AVX2 static void Score(__m256i, __m256i, __m256i freeWidth, __m256i freeHeight, __m256i width, __m256i height, __m256i &score1, __m256i &score2)
+	{
+		score1 = _mm256_sub_epi32(_mm256_mullo_epi32(freeWidth, freeHeight), _mm256_mullo_epi32(width, height));
+		score2 = _mm256_min_epi32(_mm256_sub_epi32(freeWidth, width), _mm256_sub_epi32(freeHeight, height));
+	}
+#endif
+};
+
+struct BottomLeftScore
+{
+	static void Score(int freeX, int freeY, int, int, int, int height, int &score1, int &score2)
+	{
+		score1 = freeY + height;
+		score2 = freeX;
+	}
+#ifdef RBP_AVX2
+	RBP_TARGET_AVX2 static void Score(__m256i freeX, __m256i freeY, __m256i, __m256i, __m256i, __m256i height, __m256i &score1, __m256i &score2)
+	{
+		score1 = _mm256_add_epi32(freeY, height);
+		score2 = freeX;
+	}
+#endif
+};
+
+/// The best few placements found for one rectangle during a batch Insert, best first. Ties are ordered the way a scan
+/// over the free list meets them. Every placement that isn't listed scores no better than the last listed one.
+struct MaxRectsBinPack::CachedPlacements
+{
+	enum { Capacity = 4 };
+
+	struct Placement
+	{
+		int score1;
+		int score2;
+		Rect node;
+		Rect freeRect;
+	};
+
+	Placement placements[Capacity];
+	int count;
+
+	/// True if every placement that fits is listed, so an empty list means the rectangle doesn't fit at all.
+	bool complete;
+
+	/// True if the list ran dry while incomplete, so the free list has to be scanned again.
+	bool stale;
+
+	/// Offers a placement found later in the free list than all the listed ones.
+	void Offer(int score1, int score2, const Rect &node, const Rect &freeRect)
+	{
+		int pos = count;
+		while(pos > 0 && (score1 < placements[pos - 1].score1 ||
+			(score1 == placements[pos - 1].score1 && score2 < placements[pos - 1].score2)))
+			--pos;
+
+		// An unlisted placement may beat this one, unless the list is known to hold all of them.
+		if (pos == count && (!complete || count == Capacity))
+		{
+			if (count == Capacity)
+				complete = false;
+			return;
+		}
+
+		if (count == Capacity)
+			complete = false;
+		else
+			++count;
+		for(int i = count - 1; i > pos; --i)
+			placements[i] = placements[i - 1];
+
+		placements[pos].score1 = score1;
+		placements[pos].score2 = score2;
+		placements[pos].node = node;
+		placements[pos].freeRect = freeRect;
+	}
+
+	/// Drops the placements whose free rectangle overlaps the given node.
+	void Invalidate(const Rect &usedNode)
+	{
+		int numKept = 0;
+		for(int i = 0; i < count; ++i)
+			if (DisjointRectCollection::Disjoint(placements[i].freeRect, usedNode))
+				placements[numKept++] = placements[i];
+		count = numKept;
+		stale = count == 0 && !complete;
+	}
+};
+
+#ifdef RBP_AVX2
+/// Scores eight free rectangles for a width x height placement, and keeps the lanes where it beats the best one found
+/// so far in that lane. candidate holds the candidate number of each lane.
+template<class ScorePolicy>
+RBP_TARGET_AVX2 static inline void ScoreCandidates(__m256i freeX, __m256i freeY, __m256i freeWidth, __m256i freeHeight, __m256i width, __m256i height,
+	__m256i candidate, __m256i &bestScore1, __m256i &bestScore2, __m256i &bestCandidate)
+{
+	const __m256i one = _mm256_set1_epi32(1);
+	__m256i fits = _mm256_and_si256(_mm256_cmpgt_epi32(freeWidth, _mm256_sub_epi32(width, one)),
+		_mm256_cmpgt_epi32(freeHeight, _mm256_sub_epi32(height, one)));
+
+	__m256i score1, score2;
+	ScorePolicy::Score(freeX, freeY, freeWidth, freeHeight, width, height, score1, score2);
+
+	__m256i better = _mm256_or_si256(_mm256_cmpgt_epi32(bestScore1, score1),
+		_mm256_and_si256(_mm256_cmpeq_epi32(bestScore1, score1), _mm256_cmpgt_epi32(bestScore2, score2)));
+	better = _mm256_and_si256(better, fits);
+
+	bestScore1 = _mm256_blendv_epi8(bestScore1, score1, better);
+	bestScore2 = _mm256_blendv_epi8(bestScore2, score2, better);
+	bestCandidate = _mm256_blendv_epi8(bestCandidate, candidate, better);
+}
+#endif
+
 MaxRectsBinPack::MaxRectsBinPack()
 :binWidth(0),
-binHeight(0)
+binHeight(0),
+numDeadRectangles(0),
+numAddedFreeRectangles(0),
+gridCellSize(1),
+gridColumns(0),
+gridRows(0)
 {
 }
 
@@ -43,51 +242,159 @@ void MaxRectsBinPack::Init(int width, int height)
 	n.height = height;
 
 	usedRectangles.clear();
-
-	freeRectangles.clear();
-	freeRectangles.push_back(n);
+	edgeSpans.clear();
+	verticalEdges.assign(width + 1, -1);
+	horizontalEdges.assign(height + 1, -1);
+
+	freeX.clear();
+	freeY.clear();
+	freeWidth.clear();
+	freeHeight.clear();
+	freeX.reserve(256);
+	freeY.reserve(256);
+	freeWidth.reserve(256);
+	freeHeight.reserve(256);
+	AddFreeRect(n);
+	newFreeRectangles.reserve(64);
+	numDeadRectangles = 0;
+	numAddedFreeRectangles = 0;
+
+	// Aim for at most 32x32 cells. Free rectangles tend to be long strips and are registered in every cell
+	// they overlap, so a finer grid costs more to maintain than it saves on lookups.
+	gridCellSize = max(16, (max(width, height) + 31) / 32);
+	gridColumns = max(1, (width + gridCellSize - 1) / gridCellSize);
+	gridRows = max(1, (height + gridCellSize - 1) / gridCellSize);
+	gridCells.assign(gridColumns * gridRows, std::vector<int>());
+	RebuildGrid();
 }
 
 Rect MaxRectsBinPack::Insert(int width, int height, bool rot, FreeRectChoiceHeuristic method)
 {
-	Rect newNode;
 	// Unused in this function. We don't need to know the score after finding the position.
-	int score1 = std::numeric_limits<int>::max();
-	int score2 = std::numeric_limits<int>::max();
+	int score1;
+	int score2;
+	Rect newNode = ScoreRect(width, height, rot, method, score1, score2);
+
+	if (newNode.height == 0)
+		return newNode;
+
+	PlaceRect(newNode);
+	return newNode;
+}
+
+void MaxRectsBinPack::Occupy(const Rect &rect)
+{
+	PlaceRect(rect);
+}
+
+void MaxRectsBinPack::Insert(std::vector<RectSize> &rects, std::vector<Rect> &dst, bool rot, FreeRectChoiceHeuristic method)
+{
+	std::vector<int> order;
+	Insert(rects, dst, order, rot, method);
+}
+
+void MaxRectsBinPack::Insert(std::vector<RectSize> &rects, std::vector<Rect> &dst, std::vector<int> &order, bool rot, FreeRectChoiceHeuristic method)
+{
 	switch(method)
 	{
-		case RectBestShortSideFit: newNode = FindPositionForNewNodeBestShortSideFit(rot, width, height, score1, score2); break;
-		case RectBottomLeftRule: newNode = FindPositionForNewNodeBottomLeft(rot, width, height, score1, score2); break;
-		case RectContactPointRule: newNode = FindPositionForNewNodeContactPoint(rot, width, height, score1); break;
-		case RectBestLongSideFit: newNode = FindPositionForNewNodeBestLongSideFit(rot, width, height, score2, score1); break;
-		case RectBestAreaFit: newNode = FindPositionForNewNodeBestAreaFit(rot, width, height, score1, score2); break;
+	case RectBestShortSideFit:
+		if (rot)
+			InsertCached<BestShortSideFitScore, true>(rects, dst, order);
+		else
+			InsertCached<BestShortSideFitScore, false>(rects, dst, order);
+		return;
+	case RectBottomLeftRule:
+		if (rot)
+			InsertCached<BottomLeftScore, true>(rects, dst, order);
+		else
+			InsertCached<BottomLeftScore, false>(rects, dst, order);
+		return;
+	case RectBestLongSideFit:
+		if (rot)
+			InsertCached<BestLongSideFitScore, true>(rects, dst, order);
+		else
+			InsertCached<BestLongSideFitScore, false>(rects, dst, order);
+		return;
+	case RectBestAreaFit:
+		if (rot)
+			InsertCached<BestAreaFitScore, true>(rects, dst, order);
+		else
+			InsertCached<BestAreaFitScore, false>(rects, dst, order);
+		return;
+	case RectContactPointRule:
+		break;
 	}
-		
-	if (newNode.height == 0)
-		return newNode;
 
-	size_t numRectanglesToProcess = freeRectangles.size();
-	for(size_t i = 0; i < numRectanglesToProcess; ++i)
+	// The -CP scores depend on the placed rectangles as well, so every rectangle gets rescored every round.
+	dst.clear();
+	order.clear();
+
+	// Placed rectangles are flagged rather than erased, so that the remaining ones keep their order (which
+	// decides ties) without shifting the whole list after every placement.
+	std::vector<char> placed(rects.size(), 0);
+	size_t numPlaced = 0;
+
+	while(numPlaced < rects.size())
 	{
-		if (SplitFreeNode(freeRectangles[i], newNode))
+		int bestScore1 = std::numeric_limits<int>::max();
+		int bestScore2 = std::numeric_limits<int>::max();
+		int bestRectIndex = -1;
+		Rect bestNode;
+
+		for(size_t i = 0; i < rects.size(); ++i)
 		{
-			freeRectangles.erase(freeRectangles.begin() + i);
-			--i;
-			--numRectanglesToProcess;
+			if (placed[i])
+				continue;
+
+			int score1;
+			int score2;
+			Rect newNode = ScoreRect(rects[i].width, rects[i].height, rot, method, score1, score2);
+			if (score1 < bestScore1 || (score1 == bestScore1 && score2 < bestScore2))
+			{
+				bestScore1 = score1;
+				bestScore2 = score2;
+				bestNode = newNode;
+				bestRectIndex = i;
+			}
 		}
-	}
 
-	PruneFreeList();
+		if (bestRectIndex == -1)
+			break;
 
-	usedRectangles.push_back(newNode);
-	return newNode;
+		PlaceRect(bestNode);
+		placed[bestRectIndex] = 1;
+		++numPlaced;
+		dst.push_back(bestNode);
+		order.push_back(bestRectIndex);
+	}
+
+	// Leave only the rectangles that didn't fit in the list.
+	size_t numLeft = 0;
+	for(size_t i = 0; i < rects.size(); ++i)
+		if (!placed[i])
+			rects[numLeft++] = rects[i];
+	rects.resize(numLeft);
 }
 
-void MaxRectsBinPack::Insert(std::vector<RectSize> &rects, std::vector<Rect> &dst, bool rot, FreeRectChoiceHeuristic method)
+template<class ScorePolicy, bool Rot>
+void MaxRectsBinPack::InsertCached(std::vector<RectSize> &rects, std::vector<Rect> &dst, std::vector<int> &order)
 {
 	dst.clear();
+	order.clear();
+
+	// Rather than rescoring every rectangle against the whole free list each round, the best few placements of each
+	// rectangle are cached. Placing a node only takes away the free rectangles it overlaps and appends new ones to the
+	// end of the list, so the cached placements that survive keep their rank, and only the new free rectangles have
+	// to be scored.
+	std::vector<CachedPlacements> cache(rects.size());
+	for(size_t i = 0; i < cache.size(); ++i)
+		cache[i].stale = true;
 
-	while(rects.size() > 0)
+	std::vector<char> placed(rects.size(), 0);
+	size_t numPlaced = 0;
+	size_t firstNewFree = freeX.size();
+
+	while(numPlaced < rects.size())
 	{
 		int bestScore1 = std::numeric_limits<int>::max();
 		int bestScore2 = std::numeric_limits<int>::max();
@@ -96,46 +403,106 @@ void MaxRectsBinPack::Insert(std::vector<RectSize> &rects, std::vector<Rect> &ds
 
 		for(size_t i = 0; i < rects.size(); ++i)
 		{
-			int score1;
-			int score2;
-			Rect newNode = ScoreRect(rects[i].width, rects[i].height, rot, method, score1, score2);
+			if (placed[i])
+				continue;
+
+			CachedPlacements &c = cache[i];
+			if (c.stale)
+			{
+				c.count = 0;
+				c.complete = true;
+				c.stale = false;
+				CollectPlacements<ScorePolicy, Rot>(0, rects[i].width, rects[i].height, c);
+			}
+			else
+				CollectPlacements<ScorePolicy, Rot>(firstNewFree, rects[i].width, rects[i].height, c);
 
+			if (c.count == 0)
+				continue;
+			const int score1 = c.placements[0].score1;
+			const int score2 = c.placements[0].score2;
 			if (score1 < bestScore1 || (score1 == bestScore1 && score2 < bestScore2))
 			{
 				bestScore1 = score1;
 				bestScore2 = score2;
-				bestNode = newNode;
+				bestNode = c.placements[0].node;
 				bestRectIndex = i;
 			}
 		}
 
 		if (bestRectIndex == -1)
-			return;
+			break;
 
 		PlaceRect(bestNode);
-		rects.erase(rects.begin() + bestRectIndex);
+		placed[bestRectIndex] = 1;
+		++numPlaced;
+		dst.push_back(bestNode);
+		order.push_back(bestRectIndex);
+
+		for(size_t i = 0; i < cache.size(); ++i)
+			if (!placed[i])
+				cache[i].Invalidate(bestNode);
+		firstNewFree = freeX.size() - numAddedFreeRectangles;
 	}
+
+	// Leave only the rectangles that didn't fit in the list.
+	size_t numLeft = 0;
+	for(size_t i = 0; i < rects.size(); ++i)
+		if (!placed[i])
+			rects[numLeft++] = rects[i];
+	rects.resize(numLeft);
 }
 
 void MaxRectsBinPack::PlaceRect(const Rect &node)
 {
-	size_t numRectanglesToProcess = freeRectangles.size();
-	for(size_t i = 0; i < numRectanglesToProcess; ++i)
+	// Only the free rectangles that the node overlaps need to be split. They are visited in list order, so the
+	// new free rectangles come out in the same order as a scan over the whole list would produce them.
+	QueryGrid(node);
+
+	newFreeRectangles.clear();
+	for(size_t i = 0; i < gridQuery.size(); ++i)
 	{
-		if (SplitFreeNode(freeRectangles[i], node))
+		int index = gridQuery[i];
+		if (SplitFreeNode(GetFreeRect(index), node))
 		{
-			freeRectangles.erase(freeRectangles.begin() + i);
-			--i;
-			--numRectanglesToProcess;
+			// Leave a tombstone instead of erasing it, so the rest of the list doesn't shift. A negative size
+			// keeps every search from fitting anything into it.
+			freeWidth[index] = -1;
+			freeHeight[index] = -1;
+			++numDeadRectangles;
 		}
 	}
 
 	PruneFreeList();
 
+	// Sweep the tombstones out once they outnumber the live free rectangles.
+	if (numDeadRectangles * 2 > freeX.size())
+		CompactFreeList();
+
 	usedRectangles.push_back(node);
+
+	// Index the edges for -CP. Edges outside the bin can't touch any candidate position.
+	if (node.x >= 0 && node.x <= binWidth)
+		AddEdge(verticalEdges[node.x], node.y, node.y + node.height);
+	if (node.x + node.width >= 0 && node.x + node.width <= binWidth)
+		AddEdge(verticalEdges[node.x + node.width], node.y, node.y + node.height);
+	if (node.y >= 0 && node.y <= binHeight)
+		AddEdge(horizontalEdges[node.y], node.x, node.x + node.width);
+	if (node.y + node.height >= 0 && node.y + node.height <= binHeight)
+		AddEdge(horizontalEdges[node.y + node.height], node.x, node.x + node.width);
 	//		dst.push_back(bestNode); ///\todo Refactor so that this compiles.
 }
 
+void MaxRectsBinPack::AddEdge(int &head, int start, int end)
+{
+	EdgeSpan span;
+	span.start = start;
+	span.end = end;
+	span.next = head;
+	head = (int)edgeSpans.size();
+	edgeSpans.push_back(span);
+}
+
 Rect MaxRectsBinPack::ScoreRect(int width, int height, bool rot, FreeRectChoiceHeuristic method, int &score1, int &score2) const
 {
 	Rect newNode;
@@ -143,13 +510,13 @@ Rect MaxRectsBinPack::ScoreRect(int width, int height, bool rot, FreeRectChoiceH
 	score2 = std::numeric_limits<int>::max();
 	switch(method)
 	{
-	case RectBestShortSideFit: newNode = FindPositionForNewNodeBestShortSideFit(rot, width, height, score1, score2); break;
-	case RectBottomLeftRule: newNode = FindPositionForNewNodeBottomLeft(rot, width, height, score1, score2); break;
+	case RectBestShortSideFit: newNode = FindPositionForNewNode<BestShortSideFitScore>(rot, width, height, score1, score2); break;
+	case RectBottomLeftRule: newNode = FindPositionForNewNode<BottomLeftScore>(rot, width, height, score1, score2); break;
 	case RectContactPointRule: newNode = FindPositionForNewNodeContactPoint(rot, width, height, score1);
 		score1 = -score1; // Reverse since we are minimizing, but for contact point score bigger is better.
 		break;
-	case RectBestLongSideFit: newNode = FindPositionForNewNodeBestLongSideFit(rot, width, height, score2, score1); break;
-	case RectBestAreaFit: newNode = FindPositionForNewNodeBestAreaFit(rot, width, height, score1, score2); break;
+	case RectBestLongSideFit: newNode = FindPositionForNewNode<BestLongSideFitScore>(rot, width, height, score1, score2); break;
+	case RectBestAreaFit: newNode = FindPositionForNewNode<BestAreaFitScore>(rot, width, height, score1, score2); break;
 	}
 
 	// Cannot fit the current rectangle.
@@ -172,210 +539,227 @@ float MaxRectsBinPack::Occupancy() const
 	return (float)usedSurfaceArea / (binWidth * binHeight);
 }
 
-Rect MaxRectsBinPack::FindPositionForNewNodeBottomLeft(bool rot, int width, int height, int &bestY, int &bestX) const
+template<class ScorePolicy>
+Rect MaxRectsBinPack::FindPositionForNewNode(bool rot, int width, int height, int &bestScore1, int &bestScore2) const
 {
-	Rect bestNode;
-	memset(&bestNode, 0, sizeof(Rect));
+	if (rot)
+		return ScanFreeRectangles<ScorePolicy, true>(width, height, bestScore1, bestScore2);
+	return ScanFreeRectangles<ScorePolicy, false>(width, height, bestScore1, bestScore2);
+}
 
-	bestY = std::numeric_limits<int>::max();
-	bestX = std::numeric_limits<int>::max();
+#ifdef RBP_AVX2
+template<class ScorePolicy, bool Rot>
+RBP_TARGET_AVX2 size_t MaxRectsBinPack::ScanFreeRectanglesAvx2(int width, int height, int &bestScore1, int &bestScore2, int &bestCandidate) const
+{
+	size_t i = 0;
+	const size_t numFree = freeX.size();
+	const __m256i vWidth = _mm256_set1_epi32(width);
+	const __m256i vHeight = _mm256_set1_epi32(height);
+	const __m256i step = _mm256_set1_epi32(16);
+	const __m256i one = _mm256_set1_epi32(1);
+	__m256i candidate = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+	__m256i laneScore1 = _mm256_set1_epi32(std::numeric_limits<int>::max());
+	__m256i laneScore2 = laneScore1;
+	__m256i laneCandidate = _mm256_set1_epi32(-1);
+
+	for(; i + 8 <= numFree; i += 8)
+	{
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&freeX[i]));
+		__m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&freeY[i]));
+		__m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&freeWidth[i]));
+		__m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&freeHeight[i]));
+		ScoreCandidates<ScorePolicy>(x, y, w, h, vWidth, vHeight, candidate, laneScore1, laneScore2, laneCandidate);
+		if (Rot)
+			ScoreCandidates<ScorePolicy>(x, y, w, h, vHeight, vWidth, _mm256_add_epi32(candidate, one), laneScore1, laneScore2, laneCandidate);
+		candidate = _mm256_add_epi32(candidate, step);
+	}
 
-	for(size_t i = 0; i < freeRectangles.size(); ++i)
+	// Reduce the eight lanes down to the single best candidate.
+	int lane1[8], lane2[8], laneIndex[8];
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(lane1), laneScore1);
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(lane2), laneScore2);
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(laneIndex), laneCandidate);
+	for(int lane = 0; lane < 8; ++lane)
 	{
-		// Try to place the rectangle in upright (non-flipped) orientation.
-		if (freeRectangles[i].width >= width && freeRectangles[i].height >= height)
+		if (laneIndex[lane] < 0)
+			continue;
+		if (bestCandidate < 0 || lane1[lane] < bestScore1 || (lane1[lane] == bestScore1 &&
+			(lane2[lane] < bestScore2 || (lane2[lane] == bestScore2 && laneIndex[lane] < bestCandidate))))
 		{
-			int topSideY = freeRectangles[i].y + height;
-			if (topSideY < bestY || (topSideY == bestY && freeRectangles[i].x < bestX))
-			{
-				bestNode.x = freeRectangles[i].x;
-				bestNode.y = freeRectangles[i].y;
-				bestNode.width = width;
-				bestNode.height = height;
-				bestY = topSideY;
-				bestX = freeRectangles[i].x;
-			}
+			bestScore1 = lane1[lane];
+			bestScore2 = lane2[lane];
+			bestCandidate = laneIndex[lane];
 		}
-        if (rot)
-        {
-            if (freeRectangles[i].width >= height && freeRectangles[i].height >= width)
-            {
-                int topSideY = freeRectangles[i].y + width;
-                if (topSideY < bestY || (topSideY == bestY && freeRectangles[i].x < bestX))
-                {
-                    bestNode.x = freeRectangles[i].x;
-                    bestNode.y = freeRectangles[i].y;
-                    bestNode.width = height;
-                    bestNode.height = width;
-                    bestY = topSideY;
-                    bestX = freeRectangles[i].x;
-                }
-            }
-        }
 	}
-	return bestNode;
+	return i;
 }
+#endif
 
-Rect MaxRectsBinPack::FindPositionForNewNodeBestShortSideFit(bool rot, int width, int height,
-	int &bestShortSideFit, int &bestLongSideFit) const
+template<class ScorePolicy, bool Rot>
+Rect MaxRectsBinPack::ScanFreeRectangles(int width, int height, int &bestScore1, int &bestScore2) const
 {
 	Rect bestNode;
 	memset(&bestNode, 0, sizeof(Rect));
 
-	bestShortSideFit = std::numeric_limits<int>::max();
-	bestLongSideFit = std::numeric_limits<int>::max();
+	bestScore1 = std::numeric_limits<int>::max();
+	bestScore2 = std::numeric_limits<int>::max();
+
+	// Candidate i*2 is the upright placement into free rectangle i, and i*2+1 the flipped one. Ties go to the
+	// lowest candidate, which is the one a plain scan over the list would settle on.
+	int bestCandidate = -1;
+	size_t i = 0;
+	const size_t numFree = freeX.size();
 
-	for(size_t i = 0; i < freeRectangles.size(); ++i)
+#ifdef RBP_AVX2
+	if (numFree >= 8 && HasAvx2())
+		i = ScanFreeRectanglesAvx2<ScorePolicy, Rot>(width, height, bestScore1, bestScore2, bestCandidate);
+#endif
+
+	for(; i < numFree; ++i)
 	{
+		int score1;
+		int score2;
+
 		// Try to place the rectangle in upright (non-flipped) orientation.
-		if (freeRectangles[i].width >= width && freeRectangles[i].height >= height)
+		if (freeWidth[i] >= width && freeHeight[i] >= height)
 		{
-			int leftoverHoriz = abs(freeRectangles[i].width - width);
-			int leftoverVert = abs(freeRectangles[i].height - height);
-			int shortSideFit = min(leftoverHoriz, leftoverVert);
-			int longSideFit = max(leftoverHoriz, leftoverVert);
-
-			if (shortSideFit < bestShortSideFit || (shortSideFit == bestShortSideFit && longSideFit < bestLongSideFit))
+			ScorePolicy::Score(freeX[i], freeY[i], freeWidth[i], freeHeight[i], width, height, score1, score2);
+			if (score1 < bestScore1 || (score1 == bestScore1 && score2 < bestScore2))
 			{
-				bestNode.x = freeRectangles[i].x;
-				bestNode.y = freeRectangles[i].y;
-				bestNode.width = width;
-				bestNode.height = height;
-				bestShortSideFit = shortSideFit;
-				bestLongSideFit = longSideFit;
+				bestScore1 = score1;
+				bestScore2 = score2;
+				bestCandidate = (int)i * 2;
 			}
 		}
 
-        if (rot)
-        {
-            if (freeRectangles[i].width >= height && freeRectangles[i].height >= width)
-            {
-                int flippedLeftoverHoriz = abs(freeRectangles[i].width - height);
-                int flippedLeftoverVert = abs(freeRectangles[i].height - width);
-                int flippedShortSideFit = min(flippedLeftoverHoriz, flippedLeftoverVert);
-                int flippedLongSideFit = max(flippedLeftoverHoriz, flippedLeftoverVert);
+		if (Rot && freeWidth[i] >= height && freeHeight[i] >= width)
+		{
+			ScorePolicy::Score(freeX[i], freeY[i], freeWidth[i], freeHeight[i], height, width, score1, score2);
+			if (score1 < bestScore1 || (score1 == bestScore1 && score2 < bestScore2))
+			{
+				bestScore1 = score1;
+				bestScore2 = score2;
+				bestCandidate = (int)i * 2 + 1;
+			}
+		}
+	}
 
-                if (flippedShortSideFit < bestShortSideFit || (flippedShortSideFit == bestShortSideFit && flippedLongSideFit < bestLongSideFit))
-                {
-                    bestNode.x = freeRectangles[i].x;
-                    bestNode.y = freeRectangles[i].y;
-                    bestNode.width = height;
-                    bestNode.height = width;
-                    bestShortSideFit = flippedShortSideFit;
-                    bestLongSideFit = flippedLongSideFit;
-                }
-            }
-        }
+	if (bestCandidate >= 0)
+	{
+		size_t index = bestCandidate / 2;
+		bool flipped = (bestCandidate & 1) != 0;
+		bestNode.x = freeX[index];
+		bestNode.y = freeY[index];
+		bestNode.width = flipped ? height : width;
+		bestNode.height = flipped ? width : height;
 	}
 	return bestNode;
 }
 
-Rect MaxRectsBinPack::FindPositionForNewNodeBestLongSideFit(bool rot, int width, int height,
-	int &bestShortSideFit, int &bestLongSideFit) const
+#ifdef RBP_AVX2
+/// Scores eight free rectangles at a time, and only hands the placements that beat the last cached one to Offer,
+/// in list order. The bar only goes up as placements get offered, so this never leaves out one that Offer would
+/// have taken. Offer would turn the others away, which leaves the cache incomplete.
+template<class ScorePolicy, bool Rot>
+RBP_TARGET_AVX2 size_t MaxRectsBinPack::CollectPlacementsAvx2(size_t first, int width, int height, CachedPlacements &cache) const
 {
-	Rect bestNode;
-	memset(&bestNode, 0, sizeof(Rect));
-
-	bestShortSideFit = std::numeric_limits<int>::max();
-	bestLongSideFit = std::numeric_limits<int>::max();
-
-	for(size_t i = 0; i < freeRectangles.size(); ++i)
+	size_t i = first;
+	const size_t numFree = freeX.size();
+	const __m256i vWidth = _mm256_set1_epi32(width);
+	const __m256i vHeight = _mm256_set1_epi32(height);
+	const __m256i one = _mm256_set1_epi32(1);
+	int lane1[8], lane2[8], flipped1[8], flipped2[8];
+
+	for(; i + 8 <= numFree; i += 8)
 	{
-		// Try to place the rectangle in upright (non-flipped) orientation.
-		if (freeRectangles[i].width >= width && freeRectangles[i].height >= height)
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&freeX[i]));
+		__m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&freeY[i]));
+		__m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&freeWidth[i]));
+		__m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&freeHeight[i]));
+
+		const bool takeAll = cache.complete && cache.count < CachedPlacements::Capacity;
+		const bool takeNone = !takeAll && cache.count == 0;
+		__m256i bar1 = _mm256_set1_epi32(cache.count > 0 ? cache.placements[cache.count - 1].score1 : 0);
+		__m256i bar2 = _mm256_set1_epi32(cache.count > 0 ? cache.placements[cache.count - 1].score2 : 0);
+
+		__m256i score1, score2;
+		__m256i fits = _mm256_and_si256(_mm256_cmpgt_epi32(w, _mm256_sub_epi32(vWidth, one)),
+			_mm256_cmpgt_epi32(h, _mm256_sub_epi32(vHeight, one)));
+		ScorePolicy::Score(x, y, w, h, vWidth, vHeight, score1, score2);
+		__m256i better = _mm256_or_si256(_mm256_cmpgt_epi32(bar1, score1),
+			_mm256_and_si256(_mm256_cmpeq_epi32(bar1, score1), _mm256_cmpgt_epi32(bar2, score2)));
+		int fitMask = _mm256_movemask_ps(_mm256_castsi256_ps(fits));
+		int takeMask = takeAll ? fitMask : takeNone ? 0 : fitMask & _mm256_movemask_ps(_mm256_castsi256_ps(better));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(lane1), score1);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(lane2), score2);
+
+		int flippedFitMask = 0;
+		int flippedTakeMask = 0;
+		if (Rot)
 		{
-			int leftoverHoriz = abs(freeRectangles[i].width - width);
-			int leftoverVert = abs(freeRectangles[i].height - height);
-			int shortSideFit = min(leftoverHoriz, leftoverVert);
-			int longSideFit = max(leftoverHoriz, leftoverVert);
+			fits = _mm256_and_si256(_mm256_cmpgt_epi32(w, _mm256_sub_epi32(vHeight, one)),
+				_mm256_cmpgt_epi32(h, _mm256_sub_epi32(vWidth, one)));
+			ScorePolicy::Score(x, y, w, h, vHeight, vWidth, score1, score2);
+			better = _mm256_or_si256(_mm256_cmpgt_epi32(bar1, score1),
+				_mm256_and_si256(_mm256_cmpeq_epi32(bar1, score1), _mm256_cmpgt_epi32(bar2, score2)));
+			flippedFitMask = _mm256_movemask_ps(_mm256_castsi256_ps(fits));
+			flippedTakeMask = takeAll ? flippedFitMask : takeNone ? 0 : flippedFitMask & _mm256_movemask_ps(_mm256_castsi256_ps(better));
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(flipped1), score1);
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(flipped2), score2);
+		}
 
-			if (longSideFit < bestLongSideFit || (longSideFit == bestLongSideFit && shortSideFit < bestShortSideFit))
+		for(int lane = 0; lane < 8 && ((takeMask | flippedTakeMask) >> lane) != 0; ++lane)
+		{
+			size_t index = i + lane;
+			if (takeMask & (1 << lane))
 			{
-				bestNode.x = freeRectangles[i].x;
-				bestNode.y = freeRectangles[i].y;
-				bestNode.width = width;
-				bestNode.height = height;
-				bestShortSideFit = shortSideFit;
-				bestLongSideFit = longSideFit;
+				Rect node = { freeX[index], freeY[index], width, height };
+				cache.Offer(lane1[lane], lane2[lane], node, GetFreeRect(index));
+			}
+			if (flippedTakeMask & (1 << lane))
+			{
+				Rect node = { freeX[index], freeY[index], height, width };
+				cache.Offer(flipped1[lane], flipped2[lane], node, GetFreeRect(index));
 			}
 		}
 
-        if (rot)
-        {
-            if (freeRectangles[i].width >= height && freeRectangles[i].height >= width)
-            {
-                int leftoverHoriz = abs(freeRectangles[i].width - height);
-                int leftoverVert = abs(freeRectangles[i].height - width);
-                int shortSideFit = min(leftoverHoriz, leftoverVert);
-                int longSideFit = max(leftoverHoriz, leftoverVert);
-                
-                if (longSideFit < bestLongSideFit || (longSideFit == bestLongSideFit && shortSideFit < bestShortSideFit))
-                {
-                    bestNode.x = freeRectangles[i].x;
-                    bestNode.y = freeRectangles[i].y;
-                    bestNode.width = height;
-                    bestNode.height = width;
-                    bestShortSideFit = shortSideFit;
-                    bestLongSideFit = longSideFit;
-                }
-            }
-        }
+		if ((fitMask & ~takeMask) != 0 || (flippedFitMask & ~flippedTakeMask) != 0)
+			cache.complete = false;
 	}
-	return bestNode;
+	return i;
 }
+#endif
 
-Rect MaxRectsBinPack::FindPositionForNewNodeBestAreaFit(bool rot, int width, int height,
-	int &bestAreaFit, int &bestShortSideFit) const
+template<class ScorePolicy, bool Rot>
+void MaxRectsBinPack::CollectPlacements(size_t first, int width, int height, CachedPlacements &cache) const
 {
-	Rect bestNode;
-	memset(&bestNode, 0, sizeof(Rect));
+	size_t i = first;
+	const size_t numFree = freeX.size();
 
-	bestAreaFit = std::numeric_limits<int>::max();
-	bestShortSideFit = std::numeric_limits<int>::max();
+#ifdef RBP_AVX2
+	if (numFree - i >= 8 && HasAvx2())
+		i = CollectPlacementsAvx2<ScorePolicy, Rot>(i, width, height, cache);
+#endif
 
-	for(size_t i = 0; i < freeRectangles.size(); ++i)
+	for(; i < numFree; ++i)
 	{
-		int areaFit = freeRectangles[i].width * freeRectangles[i].height - width * height;
+		int score1;
+		int score2;
 
-		// Try to place the rectangle in upright (non-flipped) orientation.
-		if (freeRectangles[i].width >= width && freeRectangles[i].height >= height)
+		if (freeWidth[i] >= width && freeHeight[i] >= height)
 		{
-			int leftoverHoriz = abs(freeRectangles[i].width - width);
-			int leftoverVert = abs(freeRectangles[i].height - height);
-			int shortSideFit = min(leftoverHoriz, leftoverVert);
-
-			if (areaFit < bestAreaFit || (areaFit == bestAreaFit && shortSideFit < bestShortSideFit))
-			{
-				bestNode.x = freeRectangles[i].x;
-				bestNode.y = freeRectangles[i].y;
-				bestNode.width = width;
-				bestNode.height = height;
-				bestShortSideFit = shortSideFit;
-				bestAreaFit = areaFit;
-			}
+			ScorePolicy::Score(freeX[i], freeY[i], freeWidth[i], freeHeight[i], width, height, score1, score2);
+			Rect node = { freeX[i], freeY[i], width, height };
+			cache.Offer(score1, score2, node, GetFreeRect(i));
 		}
 
-        if (rot)
-        {
-            if (freeRectangles[i].width >= height && freeRectangles[i].height >= width)
-            {
-                int leftoverHoriz = abs(freeRectangles[i].width - height);
-                int leftoverVert = abs(freeRectangles[i].height - width);
-                int shortSideFit = min(leftoverHoriz, leftoverVert);
-                
-                if (areaFit < bestAreaFit || (areaFit == bestAreaFit && shortSideFit < bestShortSideFit))
-                {
-                    bestNode.x = freeRectangles[i].x;
-                    bestNode.y = freeRectangles[i].y;
-                    bestNode.width = height;
-                    bestNode.height = width;
-                    bestShortSideFit = shortSideFit;
-                    bestAreaFit = areaFit;
-                }
-            }
-        }
+		if (Rot && freeWidth[i] >= height && freeHeight[i] >= width)
+		{
+			ScorePolicy::Score(freeX[i], freeY[i], freeWidth[i], freeHeight[i], height, width, score1, score2);
+			Rect node = { freeX[i], freeY[i], height, width };
+			cache.Offer(score1, score2, node, GetFreeRect(i));
+		}
 	}
-	return bestNode;
 }
 
 /// Returns 0 if the two intervals i1 and i2 are disjoint, or the length of their overlap otherwise.
@@ -395,48 +779,64 @@ int MaxRectsBinPack::ContactPointScoreNode(int x, int y, int width, int height)
 	if (y == 0 || y + height == binHeight)
 		score += width;
 
-	for(size_t i = 0; i < usedRectangles.size(); ++i)
-	{
-		if (usedRectangles[i].x == x + width || usedRectangles[i].x + usedRectangles[i].width == x)
-			score += CommonIntervalLength(usedRectangles[i].y, usedRectangles[i].y + usedRectangles[i].height, y, y + height);
-		if (usedRectangles[i].y == y + height || usedRectangles[i].y + usedRectangles[i].height == y)
-			score += CommonIntervalLength(usedRectangles[i].x, usedRectangles[i].x + usedRectangles[i].width, x, x + width);
-	}
+	// Only the used rectangles with an edge on one of the lines the candidate's edges lie on can touch it. The
+	// chains also hold the edges facing away from the candidate, but those belong to rectangles that would overlap
+	// it, which can't happen at a free position, so they only ever share a single point with it and add nothing.
+	score += EdgeContact(verticalEdges[x], y, y + height);
+	score += EdgeContact(verticalEdges[x + width], y, y + height);
+	score += EdgeContact(horizontalEdges[y], x, x + width);
+	score += EdgeContact(horizontalEdges[y + height], x, x + width);
 	return score;
 }
 
+int MaxRectsBinPack::EdgeContact(int head, int start, int end) const
+{
+	int contact = 0;
+	for(int i = head; i >= 0; i = edgeSpans[i].next)
+		contact += CommonIntervalLength(edgeSpans[i].start, edgeSpans[i].end, start, end);
+	return contact;
+}
+
 Rect MaxRectsBinPack::FindPositionForNewNodeContactPoint(bool rot, int width, int height, int &bestContactScore) const
+{
+	if (rot)
+		return ScanContactPoints<true>(width, height, bestContactScore);
+	return ScanContactPoints<false>(width, height, bestContactScore);
+}
+
+template<bool Rot>
+Rect MaxRectsBinPack::ScanContactPoints(int width, int height, int &bestContactScore) const
 {
 	Rect bestNode;
 	memset(&bestNode, 0, sizeof(Rect));
 
 	bestContactScore = -1;
 
-	for(size_t i = 0; i < freeRectangles.size(); ++i)
+	for(size_t i = 0; i < freeX.size(); ++i)
 	{
 		// Try to place the rectangle in upright (non-flipped) orientation.
-		if (freeRectangles[i].width >= width && freeRectangles[i].height >= height)
+		if (freeWidth[i] >= width && freeHeight[i] >= height)
 		{
-			int score = ContactPointScoreNode(freeRectangles[i].x, freeRectangles[i].y, width, height);
+			int score = ContactPointScoreNode(freeX[i], freeY[i], width, height);
 			if (score > bestContactScore)
 			{
-				bestNode.x = freeRectangles[i].x;
-				bestNode.y = freeRectangles[i].y;
+				bestNode.x = freeX[i];
+				bestNode.y = freeY[i];
 				bestNode.width = width;
 				bestNode.height = height;
 				bestContactScore = score;
 			}
 		}
         
-        if (rot)
+        if (Rot)
         {
-            if (freeRectangles[i].width >= height && freeRectangles[i].height >= width)
+            if (freeWidth[i] >= height && freeHeight[i] >= width)
             {
-                int score = ContactPointScoreNode(freeRectangles[i].x, freeRectangles[i].y, height, width);
+                int score = ContactPointScoreNode(freeX[i], freeY[i], height, width);
                 if (score > bestContactScore)
                 {
-                    bestNode.x = freeRectangles[i].x;
-                    bestNode.y = freeRectangles[i].y;
+                    bestNode.x = freeX[i];
+                    bestNode.y = freeY[i];
                     bestNode.width = height;
                     bestNode.height = width;
                     bestContactScore = score;
@@ -461,7 +861,7 @@ bool MaxRectsBinPack::SplitFreeNode(Rect freeNode, const Rect &usedNode)
 		{
 			Rect newNode = freeNode;
 			newNode.height = usedNode.y - newNode.y;
-			freeRectangles.push_back(newNode);
+			newFreeRectangles.push_back(newNode);
 		}
 
 		// New node at the bottom side of the used node.
@@ -470,7 +870,7 @@ bool MaxRectsBinPack::SplitFreeNode(Rect freeNode, const Rect &usedNode)
 			Rect newNode = freeNode;
 			newNode.y = usedNode.y + usedNode.height;
 			newNode.height = freeNode.y + freeNode.height - (usedNode.y + usedNode.height);
-			freeRectangles.push_back(newNode);
+			newFreeRectangles.push_back(newNode);
 		}
 	}
 
@@ -481,7 +881,7 @@ bool MaxRectsBinPack::SplitFreeNode(Rect freeNode, const Rect &usedNode)
 		{
 			Rect newNode = freeNode;
 			newNode.width = usedNode.x - newNode.x;
-			freeRectangles.push_back(newNode);
+			newFreeRectangles.push_back(newNode);
 		}
 
 		// New node at the right side of the used node.
@@ -490,7 +890,7 @@ bool MaxRectsBinPack::SplitFreeNode(Rect freeNode, const Rect &usedNode)
 			Rect newNode = freeNode;
 			newNode.x = usedNode.x + usedNode.width;
 			newNode.width = freeNode.x + freeNode.width - (usedNode.x + usedNode.width);
-			freeRectangles.push_back(newNode);
+			newFreeRectangles.push_back(newNode);
 		}
 	}
 
@@ -499,41 +899,112 @@ bool MaxRectsBinPack::SplitFreeNode(Rect freeNode, const Rect &usedNode)
 
 void MaxRectsBinPack::PruneFreeList()
 {
-	/* 
-	///  Would be nice to do something like this, to avoid a Theta(n^2) loop through each pair.
-	///  But unfortunately it doesn't quite cut it, since we also want to detect containment. 
-	///  Perhaps there's another way to do this faster than Theta(n^2).
+	/// The free rectangle list was already pruned after the previous placement, so only the rectangles that were
+	/// just split off can be redundant. None of them can contain an old free rectangle either, since each one lies
+	/// strictly inside the free rectangle it was split from, and that one was not redundant. So each new rectangle
+	/// only has to be tested against the old rectangles covering its top-left corner and against its siblings.
+	/// Of two identical new rectangles, the later one is kept, as the pairwise Theta(n^2) loop used to do.
+	numAddedFreeRectangles = 0;
+	for(size_t i = 0; i < newFreeRectangles.size(); ++i)
+	{
+		const Rect &rect = newFreeRectangles[i];
+		bool redundant = false;
+
+		const std::vector<int> &cell = gridCells[(rect.y / gridCellSize) * gridColumns + rect.x / gridCellSize];
+		for(size_t j = 0; j < cell.size() && !redundant; ++j)
+			redundant = freeWidth[cell[j]] > 0 && IsContainedIn(rect, GetFreeRect(cell[j]));
 
-	if (freeRectangles.size() > 0)
-		clb::sort::QuickSort(&freeRectangles[0], freeRectangles.size(), NodeSortCmp);
+		for(size_t j = 0; j < newFreeRectangles.size() && !redundant; ++j)
+			if (j != i && IsContainedIn(rect, newFreeRectangles[j]))
+				redundant = j > i || !IsContainedIn(newFreeRectangles[j], rect);
 
-	for(size_t i = 0; i < freeRectangles.size()-1; ++i)
-		if (freeRectangles[i].x == freeRectangles[i+1].x &&
-		    freeRectangles[i].y == freeRectangles[i+1].y &&
-		    freeRectangles[i].width == freeRectangles[i+1].width &&
-		    freeRectangles[i].height == freeRectangles[i+1].height)
+		if (!redundant)
 		{
-			freeRectangles.erase(freeRectangles.begin() + i);
-			--i;
+			AddFreeRect(rect);
+			AddToGrid((int)freeX.size() - 1);
+			++numAddedFreeRectangles;
 		}
-	*/
+	}
+}
 
-	/// Go through each pair and remove any rectangle that is redundant.
-	for(size_t i = 0; i < freeRectangles.size(); ++i)
-		for(size_t j = i+1; j < freeRectangles.size(); ++j)
+void MaxRectsBinPack::CompactFreeList()
+{
+	size_t numLive = 0;
+	for(size_t i = 0; i < freeX.size(); ++i)
+	{
+		if (freeWidth[i] > 0)
 		{
-			if (IsContainedIn(freeRectangles[i], freeRectangles[j]))
-			{
-				freeRectangles.erase(freeRectangles.begin()+i);
-				--i;
-				break;
-			}
-			if (IsContainedIn(freeRectangles[j], freeRectangles[i]))
-			{
-				freeRectangles.erase(freeRectangles.begin()+j);
-				--j;
-			}
+			freeX[numLive] = freeX[i];
+			freeY[numLive] = freeY[i];
+			freeWidth[numLive] = freeWidth[i];
+			freeHeight[numLive] = freeHeight[i];
+			++numLive;
 		}
+	}
+	freeX.resize(numLive);
+	freeY.resize(numLive);
+	freeWidth.resize(numLive);
+	freeHeight.resize(numLive);
+	numDeadRectangles = 0;
+	RebuildGrid();
+}
+
+Rect MaxRectsBinPack::GetFreeRect(size_t index) const
+{
+	Rect rect;
+	rect.x = freeX[index];
+	rect.y = freeY[index];
+	rect.width = freeWidth[index];
+	rect.height = freeHeight[index];
+	return rect;
+}
+
+void MaxRectsBinPack::AddFreeRect(const Rect &rect)
+{
+	freeX.push_back(rect.x);
+	freeY.push_back(rect.y);
+	freeWidth.push_back(rect.width);
+	freeHeight.push_back(rect.height);
+}
+
+void MaxRectsBinPack::AddToGrid(int index)
+{
+	int x0 = freeX[index] / gridCellSize;
+	int y0 = freeY[index] / gridCellSize;
+	int x1 = min((freeX[index] + freeWidth[index] - 1) / gridCellSize, gridColumns - 1);
+	int y1 = min((freeY[index] + freeHeight[index] - 1) / gridCellSize, gridRows - 1);
+	for(int y = y0; y <= y1; ++y)
+		for(int x = x0; x <= x1; ++x)
+			gridCells[y * gridColumns + x].push_back(index);
+}
+
+void MaxRectsBinPack::RebuildGrid()
+{
+	for(size_t i = 0; i < gridCells.size(); ++i)
+		gridCells[i].clear();
+	for(size_t i = 0; i < freeX.size(); ++i)
+		AddToGrid((int)i);
+}
+
+void MaxRectsBinPack::QueryGrid(const Rect &rect)
+{
+	gridQuery.clear();
+	int x0 = max(rect.x / gridCellSize, 0);
+	int y0 = max(rect.y / gridCellSize, 0);
+	int x1 = min((rect.x + rect.width - 1) / gridCellSize, gridColumns - 1);
+	int y1 = min((rect.y + rect.height - 1) / gridCellSize, gridRows - 1);
+	for(int y = y0; y <= y1; ++y)
+		for(int x = x0; x <= x1; ++x)
+		{
+			const std::vector<int> &cell = gridCells[y * gridColumns + x];
+			for(size_t i = 0; i < cell.size(); ++i)
+				if (freeWidth[cell[i]] > 0)
+					gridQuery.push_back(cell[i]);
+		}
+
+	// A rectangle spanning several cells is listed once per cell.
+	sort(gridQuery.begin(), gridQuery.end());
+	gridQuery.erase(unique(gridQuery.begin(), gridQuery.end()), gridQuery.end());
 }
 
 }
@@ -44,9 +44,18 @@ public:
 	/// @param method The rectangle placement rule to use when packing.
 	void Insert(std::vector<RectSize> &rects, std::vector<Rect> &dst, bool rot, FreeRectChoiceHeuristic method);
 
+	/// Inserts the given list of rectangles in an offline/batch mode, possibly rotated. At each step, the rectangle
+	/// that fits best anywhere in the bin is placed. When packing stops, rects is left with the ones that didn't fit.
+	/// @param dst [out] This list will contain the packed rectangles, in the order they were packed.
+	/// @param order [out] For each entry in dst, the index in rects of the rectangle that was packed there.
+	void Insert(std::vector<RectSize> &rects, std::vector<Rect> &dst, std::vector<int> &order, bool rot, FreeRectChoiceHeuristic method);
+
 	/// Inserts a single rectangle into the bin, possibly rotated.
 	Rect Insert(int width, int height, bool rot, FreeRectChoiceHeuristic method);
 
+	/// Marks the given area of the bin as used, as if a rectangle had been inserted there. The area has to be free.
+	void Occupy(const Rect &rect);
+
 	/// Computes the ratio of used surface area to the total bin area.
 	float Occupancy() const;
 
@@ -55,7 +64,48 @@ private:
 	int binHeight;
 
 	std::vector<Rect> usedRectangles;
-	std::vector<Rect> freeRectangles;
+
+	/// The free rectangles, in the order they were created, stored as separate coordinate arrays so that the
+	/// placement searches can score several of them at once. Rectangles that get split are left in place with
+	/// a negative size until CompactFreeList sweeps them out, so removing one never shifts the rest of the list.
+	std::vector<int> freeX;
+	std::vector<int> freeY;
+	std::vector<int> freeWidth;
+	std::vector<int> freeHeight;
+	size_t numDeadRectangles;
+
+	/// How many free rectangles the last placement appended to the end of the free list.
+	size_t numAddedFreeRectangles;
+
+	/// The free rectangles produced by the split in progress. They are pruned and then appended to the free list.
+	std::vector<Rect> newFreeRectangles;
+
+	/// A uniform grid over the bin. Each cell lists the indices of the free rectangles that overlap it, so that
+	/// splitting and pruning only need to look at the free rectangles near the node being placed. Cells may still
+	/// list dead free rectangles until the next compaction.
+	int gridCellSize;
+	int gridColumns;
+	int gridRows;
+	std::vector<std::vector<int> > gridCells;
+
+	/// Scratch space for PlaceRect, kept around to avoid reallocating on every placement.
+	std::vector<int> gridQuery;
+
+	/// An edge of a used rectangle, as the span it covers along the line it lies on. Spans on the same line are
+	/// chained together through next, ending with -1.
+	struct EdgeSpan
+	{
+		int start;
+		int end;
+		int next;
+	};
+
+	/// The edges of the used rectangles, bucketed by the line they lie on, so that -CP only has to look at the
+	/// rectangles that can touch a candidate position. verticalEdges[x] heads the chain of the left and right
+	/// edges at x, horizontalEdges[y] the chain of the top and bottom edges at y.
+	std::vector<EdgeSpan> edgeSpans;
+	std::vector<int> verticalEdges;
+	std::vector<int> horizontalEdges;
 
 	/// Computes the placement score for placing the given rectangle with the given method.
 	/// @param score1 [out] The primary placement score will be outputted here.
@@ -69,17 +119,69 @@ private:
 	/// Computes the placement score for the -CP variant.
 	int ContactPointScoreNode(int x, int y, int width, int height) const;
 
-	Rect FindPositionForNewNodeBottomLeft(bool rot, int width, int height, int &bestY, int &bestX) const;
-	Rect FindPositionForNewNodeBestShortSideFit(bool rot, int width, int height, int &bestShortSideFit, int &bestLongSideFit) const;
-	Rect FindPositionForNewNodeBestLongSideFit(bool rot, int width, int height, int &bestShortSideFit, int &bestLongSideFit) const;
-	Rect FindPositionForNewNodeBestAreaFit(bool rot, int width, int height, int &bestAreaFit, int &bestShortSideFit) const;
+	/// Finds the placement that minimizes the (score1, score2) pair computed by ScorePolicy, which is one of the
+	/// -BSSF, -BLSF, -BAF and -BL scoring rules.
+	template<class ScorePolicy>
+	Rect FindPositionForNewNode(bool rot, int width, int height, int &bestScore1, int &bestScore2) const;
+
+	/// The search loop behind FindPositionForNewNode, specialized for the scoring rule and for rotation.
+	template<class ScorePolicy, bool Rot>
+	Rect ScanFreeRectangles(int width, int height, int &bestScore1, int &bestScore2) const;
+
+	/// The part of ScanFreeRectangles that scores eight free rectangles at once with AVX2, which only gets called on
+	/// CPUs that support it. Updates the best placement so far and returns the index of the first free rectangle
+	/// it left for the plain loop.
+	template<class ScorePolicy, bool Rot>
+	size_t ScanFreeRectanglesAvx2(int width, int height, int &bestScore1, int &bestScore2, int &bestCandidate) const;
+
 	Rect FindPositionForNewNodeContactPoint(bool rot, int width, int height, int &contactScore) const;
 
+	/// The search loop behind FindPositionForNewNodeContactPoint, specialized for rotation.
+	template<bool Rot>
+	Rect ScanContactPoints(int width, int height, int &bestContactScore) const;
+
+	struct CachedPlacements;
+
+	/// The batch Insert for the -BSSF, -BLSF, -BAF and -BL scoring rules, specialized for the rule and for rotation,
+	/// which caches the best few placements of each rectangle between rounds.
+	template<class ScorePolicy, bool Rot>
+	void InsertCached(std::vector<RectSize> &rects, std::vector<Rect> &dst, std::vector<int> &order);
+
+	/// Offers the placements in the free rectangles from index first onwards to the cache of a batch Insert.
+	template<class ScorePolicy, bool Rot>
+	void CollectPlacements(size_t first, int width, int height, CachedPlacements &cache) const;
+
+	/// The AVX2 part of CollectPlacements, like ScanFreeRectanglesAvx2.
+	template<class ScorePolicy, bool Rot>
+	size_t CollectPlacementsAvx2(size_t first, int width, int height, CachedPlacements &cache) const;
+
+	/// Splits freeNode around usedNode, adding the leftover pieces to newFreeRectangles.
 	/// @return True if the free node was split.
 	bool SplitFreeNode(Rect freeNode, const Rect &usedNode);
 
-	/// Goes through the free rectangle list and removes any redundant entries.
+	/// Removes any redundant entries from newFreeRectangles and appends the rest to the free rectangle list.
 	void PruneFreeList();
+
+	/// Adds an edge covering [start, end) to the chain headed at head.
+	void AddEdge(int &head, int start, int end);
+
+	/// Sums up how much of [start, end) the edges in the chain headed at head cover.
+	int EdgeContact(int head, int start, int end) const;
+
+	/// Removes the dead entries from the free rectangle list, keeping the live ones in order, and rebuilds the grid.
+	void CompactFreeList();
+
+	Rect GetFreeRect(size_t index) const;
+	void AddFreeRect(const Rect &rect);
+
+	/// Registers the free rectangle at the given index in every grid cell it overlaps.
+	void AddToGrid(int index);
+
+	/// Rebuilds the grid from scratch. Call whenever the indices of the free rectangles change.
+	void RebuildGrid();
+
+	/// Fills gridQuery with the indices of the live free rectangles that may overlap rect, in ascending order.
+	void QueryGrid(const Rect &rect);
 };
 
 }
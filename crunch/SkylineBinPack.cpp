@@ -0,0 +1,301 @@
+/** @file SkylineBinPack.cpp
+	@brief Implements different bin packer algorithms that use the SKYLINE data structure.
+
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#include <algorithm>
+#include <limits>
+
+#include <cassert>
+
+#include "SkylineBinPack.h"
+
+namespace rbp {
+
+using namespace std;
+
+SkylineBinPack::SkylineBinPack()
+:binWidth(0),
+binHeight(0),
+usedSurfaceArea(0),
+useWasteMap(false)
+{
+}
+
+SkylineBinPack::SkylineBinPack(int width, int height, bool useWasteMap)
+{
+	Init(width, height, useWasteMap);
+}
+
+void SkylineBinPack::Init(int width, int height, bool useWasteMap_)
+{
+	binWidth = width;
+	binHeight = height;
+
+	useWasteMap = useWasteMap_;
+
+	usedSurfaceArea = 0;
+	skyLine.clear();
+	SkylineNode node;
+	node.x = 0;
+	node.y = 0;
+	node.width = binWidth;
+	skyLine.push_back(node);
+
+	if (useWasteMap)
+	{
+		// The waste map starts out empty, the gaps are added to it as they are created.
+		for(int i = 0; i < NumWasteMaps; ++i)
+		{
+			wasteMaps[i].Init(width, height);
+			wasteMaps[i].GetFreeRectangles().clear();
+		}
+	}
+}
+
+Rect SkylineBinPack::Insert(int width, int height, bool rot, LevelChoiceHeuristic method)
+{
+	// Gaps left under the skyline earlier are tried first, the thinnest ones that might fit first. The waste map
+	// isn't merged, since that is quadratic in the number of gaps and there can be a great many of them.
+	if (useWasteMap)
+	{
+		for(int i = WasteMapIndex(min(width, height)); i < NumWasteMaps; ++i)
+		{
+			Rect node = wasteMaps[i].Insert(width, height, rot, false, GuillotineBinPack::RectBestShortSideFit, GuillotineBinPack::SplitMaximizeArea);
+			if (node.height != 0)
+			{
+				usedSurfaceArea += width * height;
+				return node;
+			}
+		}
+	}
+
+	int bestIndex = -1;
+	Rect node;
+	switch(method)
+	{
+	case LevelBottomLeft: node = FindPositionForNewNodeBottomLeft(width, height, rot, bestIndex); break;
+	case LevelMinWasteFit: node = FindPositionForNewNodeMinWaste(width, height, rot, bestIndex); break;
+	default: assert(false); return Rect();
+	}
+
+	if (bestIndex != -1)
+	{
+		if (useWasteMap)
+			AddWasteMapArea(bestIndex, node.width, node.y);
+		AddSkylineLevel(bestIndex, node);
+		usedSurfaceArea += width * height;
+	}
+	return node;
+}
+
+bool SkylineBinPack::RectangleFits(int skylineNodeIndex, int width, int height, int maxTop, int &y) const
+{
+	int x = skyLine[skylineNodeIndex].x;
+	if (x + width > binWidth)
+		return false;
+
+	// The nodes are contiguous and the rectangle ends within the bin, so it ends within the skyline too.
+	y = skyLine[skylineNodeIndex].y;
+	int widthLeft = width;
+	for(size_t i = skylineNodeIndex; widthLeft > 0; ++i)
+	{
+		y = max(y, skyLine[i].y);
+		if (y + height > maxTop)
+			return false;
+		widthLeft -= skyLine[i].width;
+	}
+	return true;
+}
+
+bool SkylineBinPack::RectangleFits(int skylineNodeIndex, int width, int height, int maxWastedArea, int maxTop, int &y, int &wastedArea) const
+{
+	int x = skyLine[skylineNodeIndex].x;
+	if (x + width > binWidth)
+		return false;
+
+	// The area under the rectangle so far can only grow as the rectangle covers more nodes or has to be raised
+	// further, so the search can stop as soon as it's no better than the best placement found before.
+	y = skyLine[skylineNodeIndex].y;
+	int coveredWidth = 0;
+	int coveredArea = 0;
+	for(size_t i = skylineNodeIndex; coveredWidth < width; ++i)
+	{
+		int nodeWidth = min(skyLine[i].width, width - coveredWidth);
+		y = max(y, skyLine[i].y);
+		coveredWidth += nodeWidth;
+		coveredArea += nodeWidth * skyLine[i].y;
+
+		wastedArea = y * coveredWidth - coveredArea;
+		if (y + height > binHeight || wastedArea > maxWastedArea || (wastedArea == maxWastedArea && y + height >= maxTop))
+			return false;
+	}
+	return true;
+}
+
+Rect SkylineBinPack::FindPositionForNewNodeBottomLeft(int width, int height, bool rot, int &bestIndex) const
+{
+	int bestTop = binHeight;
+	int bestWidth = std::numeric_limits<int>::max();
+	const int minSide = rot ? min(width, height) : width;
+
+	Rect bestNode = Rect();
+	bestIndex = -1;
+	for(size_t i = 0; i < skyLine.size(); ++i)
+	{
+		// The nodes are sorted by x, so nothing further right can fit either.
+		if (skyLine[i].x + minSide > binWidth)
+			break;
+
+		// A placement has to come out lower than the best one so far, or as low on a narrower node.
+		int y;
+		if (RectangleFits(i, width, height, bestTop, y))
+		{
+			if (y + height < bestTop || (y + height == bestTop && skyLine[i].width < bestWidth))
+			{
+				bestTop = y + height;
+				bestIndex = i;
+				bestWidth = skyLine[i].width;
+				bestNode.x = skyLine[i].x;
+				bestNode.y = y;
+				bestNode.width = width;
+				bestNode.height = height;
+			}
+		}
+		if (rot && RectangleFits(i, height, width, bestTop, y))
+		{
+			if (y + width < bestTop || (y + width == bestTop && skyLine[i].width < bestWidth))
+			{
+				bestTop = y + width;
+				bestIndex = i;
+				bestWidth = skyLine[i].width;
+				bestNode.x = skyLine[i].x;
+				bestNode.y = y;
+				bestNode.width = height;
+				bestNode.height = width;
+			}
+		}
+	}
+
+	return bestNode;
+}
+
+Rect SkylineBinPack::FindPositionForNewNodeMinWaste(int width, int height, bool rot, int &bestIndex) const
+{
+	int bestTop = std::numeric_limits<int>::max();
+	int bestWastedArea = std::numeric_limits<int>::max();
+	const int minSide = rot ? min(width, height) : width;
+
+	Rect bestNode = Rect();
+	bestIndex = -1;
+	for(size_t i = 0; i < skyLine.size(); ++i)
+	{
+		if (skyLine[i].x + minSide > binWidth)
+			break;
+
+		// RectangleFits only accepts placements that beat the best one so far.
+		int y;
+		int wastedArea;
+		if (RectangleFits(i, width, height, bestWastedArea, bestTop, y, wastedArea))
+		{
+			bestTop = y + height;
+			bestWastedArea = wastedArea;
+			bestIndex = i;
+			bestNode.x = skyLine[i].x;
+			bestNode.y = y;
+			bestNode.width = width;
+			bestNode.height = height;
+		}
+		if (rot && RectangleFits(i, height, width, bestWastedArea, bestTop, y, wastedArea))
+		{
+			bestTop = y + width;
+			bestWastedArea = wastedArea;
+			bestIndex = i;
+			bestNode.x = skyLine[i].x;
+			bestNode.y = y;
+			bestNode.width = height;
+			bestNode.height = width;
+		}
+	}
+
+	return bestNode;
+}
+
+void SkylineBinPack::AddWasteMapArea(int skylineNodeIndex, int width, int y)
+{
+	const int rectLeft = skyLine[skylineNodeIndex].x;
+	const int rectRight = rectLeft + width;
+	for(size_t i = skylineNodeIndex; i < skyLine.size() && skyLine[i].x < rectRight; ++i)
+	{
+		if (skyLine[i].y >= y)
+			continue;
+
+		Rect waste;
+		waste.x = skyLine[i].x;
+		waste.y = skyLine[i].y;
+		waste.width = min(rectRight, skyLine[i].x + skyLine[i].width) - waste.x;
+		waste.height = y - skyLine[i].y;
+
+		assert(waste.width > 0 && waste.height > 0);
+		wasteMaps[WasteMapIndex(min(waste.width, waste.height))].GetFreeRectangles().push_back(waste);
+	}
+}
+
+void SkylineBinPack::AddSkylineLevel(int skylineNodeIndex, const Rect &rect)
+{
+	SkylineNode newNode;
+	newNode.x = rect.x;
+	newNode.y = rect.y + rect.height;
+	newNode.width = rect.width;
+
+	// Drop the nodes that the new one covers completely, and trim the one it covers partially.
+	const int right = newNode.x + newNode.width;
+	size_t last = skylineNodeIndex;
+	while(last < skyLine.size() && skyLine[last].x + skyLine[last].width <= right)
+		++last;
+	if (last < skyLine.size() && skyLine[last].x < right)
+	{
+		skyLine[last].width -= right - skyLine[last].x;
+		skyLine[last].x = right;
+	}
+
+	// Reuse the first covered node for the new one, so that at most one erase shifts the rest of the skyline.
+	if (last == (size_t)skylineNodeIndex)
+		skyLine.insert(skyLine.begin() + skylineNodeIndex, newNode);
+	else
+	{
+		skyLine[skylineNodeIndex] = newNode;
+		skyLine.erase(skyLine.begin() + skylineNodeIndex + 1, skyLine.begin() + last);
+	}
+
+	// Merge with the neighbours if they are at the same level.
+	size_t i = skylineNodeIndex;
+	if (i + 1 < skyLine.size() && skyLine[i + 1].y == skyLine[i].y)
+	{
+		skyLine[i].width += skyLine[i + 1].width;
+		skyLine.erase(skyLine.begin() + i + 1);
+	}
+	if (i > 0 && skyLine[i - 1].y == skyLine[i].y)
+	{
+		skyLine[i - 1].width += skyLine[i].width;
+		skyLine.erase(skyLine.begin() + i);
+	}
+}
+
+int SkylineBinPack::WasteMapIndex(int shortSide)
+{
+	int index = 0;
+	while(shortSide > 1 && index < NumWasteMaps - 1)
+	{
+		shortSide >>= 1;
+		++index;
+	}
+	return index;
+}
+
+float SkylineBinPack::Occupancy() const
+{
+	return (float)usedSurfaceArea / (binWidth * binHeight);
+}
+
+}
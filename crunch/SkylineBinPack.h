@@ -0,0 +1,99 @@
+/** @file SkylineBinPack.h
+	@brief Implements different bin packer algorithms that use the SKYLINE data structure.
+
+	This work is released to Public Domain, do whatever you want with it.
+*/
+#pragma once
+
+#include <vector>
+
+#include "Rect.h"
+#include "GuillotineBinPack.h"
+
+namespace rbp {
+
+/** SkylineBinPack implements bin packing algorithms that use the SKYLINE data structure to store the bin contents.
+	Only the top edge of the packed area is tracked, so the cost of an insert grows with the width of the bin rather
+	than with the number of rectangles packed. Uses GuillotineBinPack as the waste map. */
+class SkylineBinPack
+{
+public:
+	/// Instantiates a bin of size (0,0). Call Init to create a new bin.
+	SkylineBinPack();
+
+	/// Instantiates a bin of the given size.
+	SkylineBinPack(int width, int height, bool useWasteMap);
+
+	/// (Re)initializes the packer to an empty bin of width x height units. Call whenever
+	/// you need to restart with a new bin.
+	/// @param useWasteMap If true, the gaps left under the skyline are remembered and filled in by later rectangles.
+	void Init(int width, int height, bool useWasteMap);
+
+	/// Defines the different heuristic rules that can be used to decide how to make the rectangle placements.
+	enum LevelChoiceHeuristic
+	{
+		LevelBottomLeft, ///< -BL: Places the rectangle so that its top edge is as low as possible.
+		LevelMinWasteFit ///< -MW: Places the rectangle where it leaves the smallest gap under it.
+	};
+
+	/// Inserts a single rectangle into the bin, possibly rotated.
+	Rect Insert(int width, int height, bool rot, LevelChoiceHeuristic method);
+
+	/// Computes the ratio of used surface area to the total bin area.
+	float Occupancy() const;
+
+private:
+	int binWidth;
+	int binHeight;
+
+	/// Represents a single level (a horizontal line) of the skyline.
+	struct SkylineNode
+	{
+		/// The starting x-coordinate (leftmost).
+		int x;
+
+		/// The y-coordinate of the skyline level line.
+		int y;
+
+		/// The line width. The ending coordinate (inclusive) will be x+width-1.
+		int width;
+	};
+
+	/// The skyline from left to right. The nodes are contiguous and no two neighbours have the same height.
+	std::vector<SkylineNode> skyLine;
+
+	unsigned long usedSurfaceArea;
+
+	/// If true, we use the GuillotineBinPack structure to recover wasted areas into a waste map.
+	bool useWasteMap;
+
+	/// The waste map, split up by the length of the short side of each gap: wasteMaps[i] holds the gaps whose short
+	/// side was between 2^i and 2^(i+1)-1 when they were made. A rectangle only has to search the gaps that are at least
+	/// as thick as it is, so the slivers that nothing fits into don't slow down every insert.
+	enum { NumWasteMaps = 16 };
+	GuillotineBinPack wasteMaps[NumWasteMaps];
+
+	/// Returns the index of the waste map for a gap or rectangle with the given short side.
+	static int WasteMapIndex(int shortSide);
+
+	Rect FindPositionForNewNodeBottomLeft(int width, int height, bool rot, int &bestIndex) const;
+	Rect FindPositionForNewNodeMinWaste(int width, int height, bool rot, int &bestIndex) const;
+
+	/// Finds the height the rectangle would rest at if its left edge was placed at the start of the given skyline node.
+	/// @param maxTop The search gives up as soon as the top edge of the rectangle would come out above this.
+	/// @return False if the rectangle doesn't fit there.
+	bool RectangleFits(int skylineNodeIndex, int width, int height, int maxTop, int &y) const;
+
+	/// As above, but also computes the area that would be left empty under the rectangle.
+	/// @return False if the rectangle doesn't fit there, or if it would leave more than maxWastedArea empty, or
+	///		exactly that much with its top edge at maxTop or above.
+	bool RectangleFits(int skylineNodeIndex, int width, int height, int maxWastedArea, int maxTop, int &y, int &wastedArea) const;
+
+	/// Adds the gaps under a rectangle resting at the given height on the given skyline node to the waste map.
+	void AddWasteMapArea(int skylineNodeIndex, int width, int y);
+
+	/// Raises the skyline over the given rectangle, which rests on the given skyline node.
+	void AddSkylineLevel(int skylineNodeIndex, const Rect &rect);
+};
+
+}
@@ -38,6 +38,14 @@ void WriteShort(ofstream& bin, int16_t value)
     bin.put(static_cast<uint8_t>((value >> 8) & 0xff));
 }
 
+void WriteInt(ofstream& bin, int32_t value)
+{
+    bin.put(static_cast<uint8_t>(value & 0xff));
+    bin.put(static_cast<uint8_t>((value >> 8) & 0xff));
+    bin.put(static_cast<uint8_t>((value >> 16) & 0xff));
+    bin.put(static_cast<uint8_t>((value >> 24) & 0xff));
+}
+
 void WriteByte(ofstream& bin, char value)
 {
     bin.write(&value, 1);
@@ -45,12 +53,11 @@ void WriteByte(ofstream& bin, char value)
 
 string ReadString(ifstream& bin)
 {
-    char data[256];
-    bin.read(data, 1);
-    char* chr = data;
-    while (*chr != '\0')
-        bin.read(++chr, 1);
-    return data;
+    string value;
+    char chr;
+    while (bin.read(&chr, 1) && chr != '\0')
+        value += chr;
+    return value;
 }
 
 int16_t ReadShort(ifstream& bin)
@@ -59,3 +66,17 @@ int16_t ReadShort(ifstream& bin)
     bin.read(reinterpret_cast<char*>(&value), 2);
     return value;
 }
+
+int32_t ReadInt(ifstream& bin)
+{
+    int32_t value;
+    bin.read(reinterpret_cast<char*>(&value), 4);
+    return value;
+}
+
+char ReadByte(ifstream& bin)
+{
+    char value = 0;
+    bin.read(&value, 1);
+    return value;
+}
@@ -34,8 +34,11 @@ using namespace std;
 
 void WriteString(ofstream& bin, const string& value);
 void WriteShort(ofstream& bin, int16_t value);
+void WriteInt(ofstream& bin, int32_t value);
 void WriteByte(ofstream& bin, char value);
 string ReadString(ifstream& bin);
 int16_t ReadShort(ifstream& bin);
+int32_t ReadInt(ifstream& bin);
+char ReadByte(ifstream& bin);
 
 #endif
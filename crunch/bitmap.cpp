@@ -166,19 +166,60 @@ void Bitmap::SaveAs(const string& file)
     }
 }
 
-void Bitmap::CopyPixels(const Bitmap* src, int tx, int ty)
+//Copies src, rotated if rot, into the top left corner of the cellW x cellH cell at tx, ty, and fills the rest of the cell
+//with copies of its edge pixels. Whatever falls outside of this bitmap is left out, so it can hold just a band of an atlas.
+void Bitmap::CopyCell(const Bitmap* src, int tx, int ty, bool rot, int cellW, int cellH)
 {
-    for (int y = 0; y < src->height; ++y)
-        for (int x = 0; x < src->width; ++x)
-            data[(ty + y) * width + (tx + x)] = src->data[y * src->width + x];
+    int w = rot ? src->height : src->width;
+    int h = rot ? src->width : src->height;
+    if (w <= 0 || h <= 0)
+        return;
+    int x0 = max(0, -tx);
+    int x1 = min(cellW, width - tx);
+    int y0 = max(0, -ty);
+    int y1 = min(cellH, height - ty);
+    int r = src->height - 1;
+    for (int y = y0; y < y1; ++y)
+    {
+        int sy = min(y, h - 1);
+        uint32_t* row = data + (ty + y) * width + tx;
+        int end = min(x1, w);
+        if (rot)
+        {
+            for (int x = x0; x < end; ++x)
+                row[x] = src->data[(r - x) * src->width + sy];
+        }
+        else if (x0 < end)
+            memcpy(row + x0, src->data + sy * src->width + x0, sizeof(uint32_t) * (end - x0));
+        if (x1 > w)
+        {
+            uint32_t edge = rot ? src->data[(r - (w - 1)) * src->width + sy] : src->data[sy * src->width + w - 1];
+            for (int x = max(x0, w); x < x1; ++x)
+                row[x] = edge;
+        }
+    }
 }
 
-void Bitmap::CopyPixelsRot(const Bitmap* src, int tx, int ty)
+//Copies the pixels of src that aren't fully transparent to tx, ty, rotated if rot, clipped to this bitmap
+void Bitmap::CopyVisible(const Bitmap* src, int tx, int ty, bool rot)
 {
+    int w = rot ? src->height : src->width;
+    int h = rot ? src->width : src->height;
+    int x0 = max(0, -tx);
+    int x1 = min(w, width - tx);
+    int y0 = max(0, -ty);
+    int y1 = min(h, height - ty);
     int r = src->height - 1;
-    for (int y = 0; y < src->width; ++y)
-        for (int x = 0; x < src->height; ++x)
-            data[(ty + y) * width + (tx + x)] = src->data[(r - x) * src->width + y];
+    for (int y = y0; y < y1; ++y)
+    {
+        uint32_t* row = data + (ty + y) * width + tx;
+        for (int x = x0; x < x1; ++x)
+        {
+            uint32_t pixel = rot ? src->data[(r - x) * src->width + y] : src->data[y * src->width + x];
+            if (pixel >> 24)
+                row[x] = pixel;
+        }
+    }
 }
 
 bool Bitmap::Equals(const Bitmap* other) const
@@ -48,8 +48,8 @@ struct Bitmap
     Bitmap(int width, int height);
     ~Bitmap();
     void SaveAs(const string& file);
-    void CopyPixels(const Bitmap* src, int tx, int ty);
-    void CopyPixelsRot(const Bitmap* src, int tx, int ty);
+    void CopyCell(const Bitmap* src, int tx, int ty, bool rot, int cellW, int cellH);
+    void CopyVisible(const Bitmap* src, int tx, int ty, bool rot);
     bool Equals(const Bitmap* other) const;
 };
 
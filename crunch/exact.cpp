@@ -0,0 +1,281 @@
+/*
+ 
+ MIT License
+ 
+ Copyright (c) 2017 Chevy Ray Johnston
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ 
+ */
+
+#include "exact.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <atomic>
+#include <limits>
+
+using namespace std;
+using namespace rbp;
+
+namespace
+{
+    struct Segment
+    {
+        int x;
+        int y;
+        int width;
+    };
+    
+    //A depth-first search that always fills the lowest, leftmost gap in the skyline: either by putting a rect in
+    //its bottom-left corner, or by giving up on the gap and raising it to the lower of its neighbours. Rects of the
+    //same size are interchangeable, so they're grouped by size and only tried once per gap.
+    struct Search
+    {
+        int width;
+        int height;
+        bool rotate;
+        
+        vector<RectSize> sizes;
+        vector<vector<int>> items;
+        vector<size_t> numPlaced;
+        
+        vector<Segment> skyline;
+        vector<Rect> placements;
+        
+        //The area that isn't used or wasted yet, minus the area of the rects still to go
+        long long slack;
+        long long remaining;
+        
+        size_t nodes;
+        size_t maxNodes;
+        bool gaveUp;
+        
+        //Set once an earlier branch has found a packing, so this one can stop
+        const atomic<size_t>* winner;
+        size_t branch;
+        
+        bool Run();
+        void Place(size_t index, int w, int h, size_t type);
+        void MergeSkyline();
+    };
+}
+
+void Search::MergeSkyline()
+{
+    size_t j = 0;
+    for (size_t i = 1; i < skyline.size(); ++i)
+    {
+        if (skyline[i].y == skyline[j].y)
+            skyline[j].width += skyline[i].width;
+        else
+            skyline[++j] = skyline[i];
+    }
+    skyline.resize(j + 1);
+}
+
+void Search::Place(size_t index, int w, int h, size_t type)
+{
+    Segment& segment = skyline[index];
+    int item = items[type][numPlaced[type]++];
+    placements[item] = Rect { segment.x, segment.y, w, h };
+    remaining -= static_cast<long long>(w) * h;
+    
+    Segment rest = { segment.x + w, segment.y, segment.width - w };
+    segment.y += h;
+    segment.width = w;
+    if (rest.width > 0)
+        skyline.insert(skyline.begin() + index + 1, rest);
+    MergeSkyline();
+}
+
+bool Search::Run()
+{
+    if (remaining == 0)
+        return true;
+    if (++nodes > maxNodes)
+    {
+        gaveUp = true;
+        return false;
+    }
+    if ((nodes & 1023) == 0 && winner->load() < branch)
+        return false;
+    
+    size_t index = 0;
+    for (size_t i = 1; i < skyline.size(); ++i)
+        if (skyline[i].y < skyline[index].y)
+            index = i;
+    Segment segment = skyline[index];
+    
+    //Nothing ever gets placed below the lowest gap, so every rect left has to fit in the height above it
+    for (size_t t = 0; t < sizes.size(); ++t)
+    {
+        if (numPlaced[t] == items[t].size())
+            continue;
+        int h = numeric_limits<int>::max();
+        if (sizes[t].width <= width)
+            h = sizes[t].height;
+        if (rotate && sizes[t].height <= width)
+            h = min(h, sizes[t].width);
+        if (h > height - segment.y)
+            return false;
+    }
+    
+    vector<Segment> saved = skyline;
+    for (size_t t = 0; t < sizes.size(); ++t)
+    {
+        if (numPlaced[t] == items[t].size())
+            continue;
+        for (int r = 0; r < (rotate && sizes[t].width != sizes[t].height ? 2 : 1); ++r)
+        {
+            int w = r ? sizes[t].height : sizes[t].width;
+            int h = r ? sizes[t].width : sizes[t].height;
+            if (w > segment.width || segment.y + h > height)
+                continue;
+            
+            Place(index, w, h, t);
+            if (Run())
+                return true;
+            skyline = saved;
+            --numPlaced[t];
+            remaining += static_cast<long long>(w) * h;
+            if (gaveUp)
+                return false;
+        }
+    }
+    
+    //Leave the gap empty. Without neighbours the gap spans the whole bin, and the bin can't get any taller.
+    if (skyline.size() == 1)
+        return false;
+    int raiseTo = numeric_limits<int>::max();
+    if (index > 0)
+        raiseTo = skyline[index - 1].y;
+    if (index + 1 < skyline.size())
+        raiseTo = min(raiseTo, skyline[index + 1].y);
+    long long waste = static_cast<long long>(segment.width) * (raiseTo - segment.y);
+    if (waste > slack)
+        return false;
+    
+    slack -= waste;
+    skyline[index].y = raiseTo;
+    MergeSkyline();
+    if (Run())
+        return true;
+    skyline = saved;
+    slack += waste;
+    return false;
+}
+
+ExactResult PackExact(const vector<RectSize>& rects, int width, int height, bool rotate, size_t& budget, vector<Rect>& placements)
+{
+    //Group the rects by size, biggest first, so the search tries the hard ones while there's still room for them
+    Search root;
+    root.width = width;
+    root.height = height;
+    root.rotate = rotate;
+    root.remaining = 0;
+    for (size_t i = 0; i < rects.size(); ++i)
+    {
+        const RectSize& rect = rects[i];
+        bool fits = rect.width <= width && rect.height <= height;
+        bool fitsRotated = rotate && rect.height <= width && rect.width <= height;
+        if (!fits && !fitsRotated)
+            return ExactResult::Impossible;
+        root.remaining += static_cast<long long>(rect.width) * rect.height;
+        
+        size_t type = 0;
+        while (type < root.sizes.size() && (root.sizes[type].width != rect.width || root.sizes[type].height != rect.height))
+            ++type;
+        if (type == root.sizes.size())
+        {
+            root.sizes.push_back(rect);
+            root.items.emplace_back();
+        }
+        root.items[type].push_back(static_cast<int>(i));
+    }
+    
+    vector<size_t> order(root.sizes.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return static_cast<long long>(root.sizes[a].width) * root.sizes[a].height > static_cast<long long>(root.sizes[b].width) * root.sizes[b].height;
+    });
+    vector<RectSize> sizes;
+    vector<vector<int>> items;
+    for (auto i : order)
+    {
+        sizes.push_back(root.sizes[i]);
+        items.push_back(root.items[i]);
+    }
+    root.sizes = sizes;
+    root.items = items;
+    
+    root.slack = static_cast<long long>(width) * height - root.remaining;
+    if (root.slack < 0)
+        return ExactResult::Impossible;
+    root.numPlaced.assign(root.sizes.size(), 0);
+    root.skyline.push_back(Segment { 0, 0, width });
+    root.placements.resize(rects.size());
+    root.nodes = 0;
+    root.gaveUp = false;
+    
+    //Every rect that could go in the bottom-left corner is a branch of its own. The threads take the next branch
+    //as they finish one, and each branch gets an equal share of the budget, so the outcome doesn't depend on
+    //how the threads get scheduled. The first branch that works wins, and the ones after it stop early.
+    vector<pair<size_t, int>> branches;
+    for (size_t t = 0; t < root.sizes.size(); ++t)
+        for (int r = 0; r < (rotate && root.sizes[t].width != root.sizes[t].height ? 2 : 1); ++r)
+            branches.push_back(make_pair(t, r));
+    
+    atomic<size_t> winner(numeric_limits<size_t>::max());
+    vector<Search> searches(branches.size(), root);
+    ParallelFor(branches.size(), [&](size_t i) {
+        Search& search = searches[i];
+        search.maxNodes = max<size_t>(budget / branches.size(), 1);
+        search.winner = &winner;
+        search.branch = i;
+        
+        size_t t = branches[i].first;
+        int w = branches[i].second ? search.sizes[t].height : search.sizes[t].width;
+        int h = branches[i].second ? search.sizes[t].width : search.sizes[t].height;
+        if (w > width || h > height)
+            return;
+        search.Place(0, w, h, t);
+        if (search.Run())
+        {
+            size_t current = winner.load();
+            while (i < current && !winner.compare_exchange_weak(current, i))
+                ;
+        }
+    });
+    
+    size_t used = 0;
+    for (auto& search : searches)
+        used += search.nodes;
+    budget -= min(budget, used);
+    
+    if (winner.load() < branches.size())
+    {
+        placements = searches[winner.load()].placements;
+        return ExactResult::Packed;
+    }
+    for (auto& search : searches)
+        if (search.gaveUp)
+            return ExactResult::GaveUp;
+    return ExactResult::Impossible;
+}
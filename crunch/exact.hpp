@@ -0,0 +1,48 @@
+/*
+ 
+ MIT License
+ 
+ Copyright (c) 2017 Chevy Ray Johnston
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ 
+ */
+
+#ifndef exact_hpp
+#define exact_hpp
+
+#include <vector>
+#include "Rect.h"
+
+using namespace std;
+
+enum class ExactResult
+{
+    Packed,
+    Impossible,
+    GaveUp
+};
+
+//Searches for a way to fit all the rects into a width x height bin, trying every bottom-left placement until one
+//works or it's certain none does. Every placement tried takes one node off the budget, and the search gives up
+//once it runs out. When packed, placements holds where each rect went, in the same order as rects, with width and
+//height swapped if rotated.
+ExactResult PackExact(const vector<rbp::RectSize>& rects, int width, int height, bool rotate, size_t& budget, vector<rbp::Rect>& placements);
+
+#endif
@@ -97,7 +97,7 @@ void HashData(size_t& hash, const char* data, size_t size)
     HashCombine(hash, str);
 }
 
-bool LoadHash(size_t& hash, const string& file)
+bool LoadHash(size_t& hash, double& freshOccupancy, const string& file)
 {
     ifstream stream(file);
     if (stream)
@@ -105,13 +105,16 @@ bool LoadHash(size_t& hash, const string& file)
         stringstream ss;
         ss << stream.rdbuf();
         ss >> hash;
+        if (!(ss >> freshOccupancy))
+            freshOccupancy = 0.0;
         return true;
     }
     return false;
 }
 
-void SaveHash(size_t hash, const string& file)
+void SaveHash(size_t hash, double freshOccupancy, const string& file)
 {
     ofstream stream(file);
-    stream << hash;
+    stream.precision(17);
+    stream << hash << endl << freshOccupancy;
 }
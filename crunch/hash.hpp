@@ -37,7 +37,10 @@ void HashString(size_t& hash, const string& str);
 void HashFile(size_t& hash, const string& file);
 void HashFiles(size_t& hash, const string& root);
 void HashData(size_t& hash, const char* data, size_t size);
-bool LoadHash(size_t& hash, const string& file);
-void SaveHash(size_t hash, const string& file);
+
+//The hash file also keeps the occupancy of the last build that packed from scratch, which --incremental compares
+//against. It's 0 if the file doesn't have one.
+bool LoadHash(size_t& hash, double& freshOccupancy, const string& file);
+void SaveHash(size_t hash, double freshOccupancy, const string& file);
 
 #endif
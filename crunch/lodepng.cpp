@@ -2068,6 +2068,50 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
   return error;
 }
 
+unsigned lodepng_deflate_part(unsigned char** out, size_t* outsize, size_t* bp,
+                              const unsigned char* in, size_t insize, unsigned final,
+                              const LodePNGCompressSettings* settings)
+{
+  unsigned error = 0;
+  size_t i, blocksize, numdeflateblocks;
+  ucvector v;
+  Hash hash;
+
+  /*stored blocks are byte aligned, they can't continue a stream at an arbitrary bit*/
+  if(settings->btype == 0 || settings->btype > 2) return 61;
+  else if(settings->btype == 1) blocksize = insize;
+  else /*if(settings->btype == 2)*/
+  {
+    blocksize = insize / 8 + 8;
+    if(blocksize < 65536) blocksize = 65536;
+    if(blocksize > 262144) blocksize = 262144;
+  }
+
+  numdeflateblocks = (insize + blocksize - 1) / blocksize;
+  if(numdeflateblocks == 0) numdeflateblocks = 1;
+
+  error = hash_init(&hash, settings->windowsize);
+  if(error) return error;
+
+  ucvector_init_buffer(&v, *out, *outsize);
+  for(i = 0; i != numdeflateblocks && !error; ++i)
+  {
+    unsigned last = final && (i == numdeflateblocks - 1);
+    size_t start = i * blocksize;
+    size_t end = start + blocksize;
+    if(end > insize) end = insize;
+
+    if(settings->btype == 1) error = deflateFixed(&v, bp, &hash, in, start, end, settings, last);
+    else error = deflateDynamic(&v, bp, &hash, in, start, end, settings, last);
+  }
+  *out = v.data;
+  *outsize = v.size;
+
+  hash_cleanup(&hash);
+
+  return error;
+}
+
 static unsigned deflate(unsigned char** out, size_t* outsize,
                         const unsigned char* in, size_t insize,
                         const LodePNGCompressSettings* settings)
@@ -787,6 +787,18 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings);
 
+/*
+Compresses data with deflate as one part of a longer deflate stream, so that a big
+input can be compressed a piece at a time. bp is the bit pointer into the out
+buffer: start with an empty buffer and *bp = 0, and pass them back in for each
+part. Only the last part may have final set. Between parts, the whole bytes
+before bit *bp may be taken out of the buffer, as long as *bp is moved back by
+the same number of bytes. Only works with btype 1 and 2.
+*/
+unsigned lodepng_deflate_part(unsigned char** out, size_t* outsize, size_t* bp,
+                              const unsigned char* in, size_t insize, unsigned final,
+                              const LodePNGCompressSettings* settings);
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
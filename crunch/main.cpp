@@ -42,23 +42,53 @@
     -f  --force             ignore the hash, forcing the packer to repack
     -u  --unique            remove duplicate bitmaps from the atlas
     -r  --rotate            enabled rotating bitmaps 90 degrees clockwise when packing
-    -s# --size#             max atlas size (# can be 4096, 2048, 1024, 512, 256, 128, or 64)
+    -g  --batch             pack whichever bitmap fits best next instead of going from largest to smallest
+    -a# --algorithm#        packing algorithm (# can be maxrects, guillotine, or skyline, see below)
+    -k# --sort#             order to pack the bitmaps in, largest first (# can be area, max-side, width, height, perimeter, or best to try them all)
+    -c  --grid              lay out runs of same-sized bitmaps in grids, then pack the rest around them
+    -l  --fill              keep filling an atlas with smaller bitmaps after one doesn't fit
+    -o  --optimize          try every heuristic and sort order at once, keeping the one with the smallest atlases
+    -n  --rebalance         spread the bitmaps over all the atlases at once, trying to get by with fewer of them
+    -y# --hierarchy#        pack each folder into a block of its own in parallel, then the blocks into atlases (folders whose block is less than # percent full get packed loose, # defaults to 60)
+    -U# --usage#            keep the groups of bitmaps listed in file # on as few atlases as possible (one group per line, names separated by spaces)
+    -A# --array#            give every atlas the same size so they can be loaded as the layers of one array texture, and save each image's layer (# can be stack to save all the layers in one png, top to bottom)
+    -q# --incremental#      keep the bitmaps that didn't change where the last build put them, packing only new and resized ones around them (repacks from scratch if that comes out less than # percent as dense as the last build that packed from scratch, # defaults to 80)
+    -i# --optimize-ms#      spend # milliseconds searching for a denser packing with random variations of the packing order, the orientations (with --rotate) and the heuristic
+    -z# --seed#             seed for --optimize-ms and --rounds, the same seed and number of rounds always give the same atlases (# defaults to 0)
+    -R# --rounds#           search for a denser packing like --optimize-ms, but for exactly # rounds instead of a time limit, so the atlases can be reproduced
+    -s# --size#             max atlas size (# can be 32768, 16384, 8192, 4096, 2048, 1024, 512, 256, 128, or 64)
+    -w# --max-width#        max atlas width (# can be from 1 to 32768)
+    -h# --max-height#       max atlas height (# can be from 1 to 32768)
+    -m# --minimize#         search for the smallest size each atlas fits in (# can be pot for powers of two, or 1 or 4 for multiples of that)
+    -e  --exact             search exhaustively for a smaller size for atlases of up to 200 bitmaps, keeping the packer's size if it takes too long
     -p# --pad#              padding between images (# can be from 0 to 16)
+    -B# --align#            snap the images to multiples of # pixels for block compression, extruding their edge pixels into the gaps (# can be from 1 to 16, # defaults to 4)
+    -D# --dense#            pack the images by their alpha channel on a grid of # pixel cells instead of by their bounding boxes, letting them interlock with --pad cells kept clear around their visible pixels (# can be from 1 to 16, # defaults to 4)
+    -V  --validate          check that no images overlap, come closer than --pad allows, or stick out of their atlas, failing if any do (checks the saved atlases if they're up to date)
+ 
+ algorithms:
+    maxrects[-HEURISTIC]                    best quality (HEURISTIC can be bssf, blsf, baf, bl, or cp)
+    guillotine[-CHOICE][-SPLIT][-merge]     faster for huge numbers of bitmaps, at some cost in density
+                                            (CHOICE can be baf, bssf, blsf, waf, wssf, or wlsf)
+                                            (SPLIT can be slas, llas, minas, maxas, sas, or las)
+    skyline[-LEVEL][-wastemap]              fastest, for tens of thousands of bitmaps or more
+                                            (LEVEL can be bl or mw, -wastemap fills in the gaps left behind)
  
  binary format:
-    [int16] num_textures (below block is repeated this many times)
+    [int32] num_textures (below block is repeated this many times)
         [string] name
-        [int16] num_images (below block is repeated this many times)
+        [int32] num_images (below block is repeated this many times)
             [string] img_name
-            [int16] img_x
-            [int16] img_y
-            [int16] img_width
-            [int16] img_height
-            [int16] img_frame_x         (if --trim enabled)
-            [int16] img_frame_y         (if --trim enabled)
-            [int16] img_frame_width     (if --trim enabled)
-            [int16] img_frame_height    (if --trim enabled)
+            [int32] img_x
+            [int32] img_y
+            [int32] img_width
+            [int32] img_height
+            [int32] img_frame_x         (if --trim enabled)
+            [int32] img_frame_y         (if --trim enabled)
+            [int32] img_frame_width     (if --trim enabled)
+            [int32] img_frame_height    (if --trim enabled)
             [byte] img_rotated          (if --rotate enabled)
+            [int32] img_layer           (if --array enabled)
  */
 
 #include <iostream>
@@ -68,17 +98,35 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+#include <queue>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <random>
+#include <limits>
+#include <cmath>
 #include "tinydir.h"
 #include "bitmap.hpp"
 #include "packer.hpp"
 #include "binary.hpp"
 #include "hash.hpp"
 #include "str.hpp"
+#include "parallel.hpp"
+#include "exact.hpp"
+#include "validate.hpp"
+#include "lodepng.h"
 
 using namespace std;
 
-static int optSize;
+static int optWidth;
+static int optHeight;
+static int optMinimize;
+static bool optExact;
 static int optPadding;
+static int optAlign;
 static bool optXml;
 static bool optBinary;
 static bool optJson;
@@ -88,6 +136,18 @@ static bool optVerbose;
 static bool optForce;
 static bool optUnique;
 static bool optRotate;
+static PackMethod optMethod;
+static bool optOptimize;
+static bool optSortBest;
+static bool optRebalance;
+static bool optValidate;
+static int optIncremental;
+static int optHierarchy;
+static string optUsage;
+static int optArray;
+static int optOptimizeMs;
+static unsigned optSeed;
+static int optRounds;
 static vector<Bitmap*> bitmaps;
 static vector<Packer*> packers;
 
@@ -169,6 +229,12 @@ static void RemoveFile(string file)
 
 static int GetPackSize(const string& str)
 {
+    if (str == "32768")
+        return 32768;
+    if (str == "16384")
+        return 16384;
+    if (str == "8192")
+        return 8192;
     if (str == "4096")
         return 4096;
     if (str == "2048")
@@ -188,6 +254,130 @@ static int GetPackSize(const string& str)
     return 0;
 }
 
+static int GetMaxSize(const string& str)
+{
+    for (int i = 1; i <= 32768; ++i)
+        if (str == to_string(i))
+            return i;
+    cerr << "invalid size: " << str << endl;
+    exit(EXIT_FAILURE);
+    return 0;
+}
+
+//Returns the number the atlas sides have to be a multiple of, or 0 if they have to be powers of two
+static int GetMinimize(const string& str)
+{
+    if (str == "pot")
+        return 0;
+    if (str == "1")
+        return 1;
+    if (str == "4")
+        return 4;
+    cerr << "invalid minimize value: " << str << endl;
+    exit(EXIT_FAILURE);
+    return 1;
+}
+
+static PackMethod GetAlgorithm(const string& str)
+{
+    PackMethod method = optMethod;
+    if (!method.ParseAlgorithm(str))
+    {
+        cerr << "invalid algorithm: " << str << endl;
+        exit(EXIT_FAILURE);
+    }
+    return method;
+}
+
+static int GetNumber(const string& str, const string& what)
+{
+    if (!str.empty() && str.size() <= 9 && all_of(str.begin(), str.end(), [](char c) { return c >= '0' && c <= '9'; }))
+        return stoi(str);
+    cerr << "invalid " << what << ": " << str << endl;
+    exit(EXIT_FAILURE);
+    return 0;
+}
+
+static SortOrder GetSort(const string& str)
+{
+    PackMethod method;
+    if (str == "best")
+        optSortBest = true;
+    else if (method.ParseSort(str))
+        optSortBest = false;
+    else
+    {
+        cerr << "invalid sort order: " << str << endl;
+        exit(EXIT_FAILURE);
+    }
+    return method.sort;
+}
+
+static int GetIncremental(const string& str)
+{
+    if (str.empty())
+        return 80;
+    for (int i = 0; i <= 100; ++i)
+        if (str == to_string(i))
+            return i;
+    cerr << "invalid occupancy: " << str << endl;
+    exit(EXIT_FAILURE);
+    return 80;
+}
+
+static int GetHierarchy(const string& str)
+{
+    if (str.empty())
+        return 60;
+    for (int i = 0; i <= 100; ++i)
+        if (str == to_string(i))
+            return i;
+    cerr << "invalid density: " << str << endl;
+    exit(EXIT_FAILURE);
+    return 60;
+}
+
+static int GetAlign(const string& str)
+{
+    if (str.empty())
+        return 4;
+    for (int i = 1; i <= 16; ++i)
+        if (str == to_string(i))
+            return i;
+    cerr << "invalid alignment: " << str << endl;
+    exit(EXIT_FAILURE);
+    return 4;
+}
+
+static int GetDense(const string& str)
+{
+    if (str.empty())
+        return 4;
+    for (int i = 1; i <= 16; ++i)
+        if (str == to_string(i))
+            return i;
+    cerr << "invalid dense cell size: " << str << endl;
+    exit(EXIT_FAILURE);
+    return 4;
+}
+
+//The room a side of a bitmap takes up in an atlas
+static int GetCell(int size)
+{
+    return GetCellSize(size, optPadding, optAlign);
+}
+
+static int GetArray(const string& str)
+{
+    if (str.empty())
+        return 0;
+    if (str == "stack")
+        return 1;
+    cerr << "invalid array layout: " << str << endl;
+    exit(EXIT_FAILURE);
+    return 0;
+}
+
 static int GetPadding(const string& str)
 {
     for (int i = 0; i <= 16; ++i)
@@ -198,6 +388,1112 @@ static int GetPadding(const string& str)
     return 1;
 }
 
+//The sizes from min to max that are multiples of step, or powers of two if step is 0, smallest first
+static vector<int> GetSizes(int min, int max, int step)
+{
+    vector<int> sizes;
+    if (step == 0)
+    {
+        for (int size = 1; size <= max; size *= 2)
+            if (size >= min)
+                sizes.push_back(size);
+    }
+    else
+    {
+        for (int size = (min + step - 1) / step * step; size <= max; size += step)
+            sizes.push_back(size);
+    }
+    return sizes;
+}
+
+//Repacks the bitmaps of an atlas into the smallest atlas they still all fit in. Packing isn't strictly monotonic in
+//the atlas size, so this finds a small size rather than the smallest possible one.
+static Packer* Minimize(Packer* packer, const PackMethod& method)
+{
+    vector<Bitmap*> page = packer->bitmaps;
+    SortBitmaps(page, method.sort);
+    
+    //Duplicates share their original's spot, so only the originals count towards the area
+    int minSide = 1;
+    size_t area = 0;
+    for (size_t i = 0; i < packer->points.size(); ++i)
+    {
+        if (packer->points[i].dupID >= 0)
+            continue;
+        int w = GetCell(packer->bitmaps[i]->width);
+        int h = GetCell(packer->bitmaps[i]->height);
+        minSide = max(minSide, optRotate ? min(w, h) : w);
+        area += static_cast<size_t>(w) * h;
+    }
+    
+    auto fits = [&](int w, int h) {
+        Packer test(w, h, optPadding, optAlign);
+        vector<Bitmap*> bitmaps = page;
+        test.Pack(bitmaps, false, optUnique, optRotate, method);
+        return bitmaps.empty();
+    };
+    
+    //For a given width, binary search for the smallest height that fits. Returns 0 if none does.
+    vector<int> heights = GetSizes(1, optHeight, optMinimize);
+    auto findHeight = [&](int w) {
+        size_t lo = lower_bound(heights.begin(), heights.end(), static_cast<int>((area + w - 1) / w)) - heights.begin();
+        size_t hi = heights.size();
+        while (lo < hi)
+        {
+            size_t mid = (lo + hi) / 2;
+            if (fits(w, heights[mid]))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        return lo < heights.size() ? heights[lo] : 0;
+    };
+    
+    //Try a spread of widths at once, then narrow in on the best one until every width in between has been tried
+    const size_t numSamples = 32;
+    vector<int> widths = GetSizes(minSide, optWidth, optMinimize);
+    size_t lo = 0;
+    size_t hi = widths.size();
+    int bestW = 0;
+    int bestH = 0;
+    while (lo < hi)
+    {
+        vector<size_t> samples;
+        if (hi - lo <= numSamples)
+        {
+            for (size_t i = lo; i < hi; ++i)
+                samples.push_back(i);
+        }
+        else
+        {
+            for (size_t i = 0; i < numSamples; ++i)
+                samples.push_back(lo + (hi - 1 - lo) * i / (numSamples - 1));
+        }
+        
+        vector<int> sampleHeights(samples.size());
+        ParallelFor(samples.size(), [&](size_t i) {
+            sampleHeights[i] = findHeight(widths[samples[i]]);
+        });
+        
+        //Ties go to the narrowest width, so the result doesn't depend on the thread timing
+        int best = -1;
+        for (size_t i = 0; i < samples.size(); ++i)
+        {
+            if (sampleHeights[i] == 0)
+                continue;
+            size_t a = static_cast<size_t>(widths[samples[i]]) * sampleHeights[i];
+            if (bestW == 0 || a < static_cast<size_t>(bestW) * bestH)
+            {
+                bestW = widths[samples[i]];
+                bestH = sampleHeights[i];
+            }
+            if (best < 0 || a < static_cast<size_t>(widths[samples[best]]) * sampleHeights[best])
+                best = static_cast<int>(i);
+        }
+        if (best < 0 || hi - lo <= numSamples)
+            break;
+        
+        //Only the widths between the neighbours of the best sample are left to try
+        size_t newLo = best > 0 ? samples[best - 1] + 1 : lo;
+        size_t newHi = best + 1 < static_cast<int>(samples.size()) ? samples[best + 1] : hi;
+        lo = newLo;
+        hi = newHi;
+    }
+    
+    if (bestW == 0 || static_cast<size_t>(bestW) * bestH >= static_cast<size_t>(packer->width) * packer->height)
+        return packer;
+    
+    auto result = new Packer(bestW, bestH, optPadding, optAlign);
+    result->Pack(page, false, optUnique, optRotate, method);
+    
+    //Packing halves the atlas while the contents fit, which would undo the alignment of the sizes searched for
+    result->width = bestW;
+    result->height = bestH;
+    delete packer;
+    return result;
+}
+
+//Looks for a smaller size that the bitmaps of an atlas fit in with an exhaustive search, trying the sizes from the
+//smallest area up. The atlas stays as it is if there are too many bitmaps, or the search doesn't find a smaller
+//size before its budget runs out.
+static Packer* PackExactly(Packer* packer)
+{
+    const size_t maxBitmaps = 200;
+    const size_t minShare = 10000;
+    size_t budget = 5000000;
+    
+    //Duplicates take up no space, they go wherever their original ends up
+    vector<size_t> originals;
+    vector<rbp::RectSize> rects;
+    size_t area = 0;
+    for (size_t i = 0; i < packer->points.size(); ++i)
+    {
+        if (packer->points[i].dupID >= 0)
+            continue;
+        rbp::RectSize rect;
+        rect.width = GetCell(packer->bitmaps[i]->width);
+        rect.height = GetCell(packer->bitmaps[i]->height);
+        originals.push_back(i);
+        rects.push_back(rect);
+        area += static_cast<size_t>(rect.width) * rect.height;
+    }
+    if (originals.empty() || originals.size() > maxBitmaps)
+        return packer;
+    
+    //The budget only stretches to a few sizes, so rather than listing every one, each width keeps a place in a queue
+    //with the next height to try, and the sizes come out smallest area first (narrowest first when tied)
+    int step = max(optMinimize, 0);
+    vector<int> widths = GetSizes(1, optWidth, step);
+    vector<int> heights = GetSizes(1, optHeight, step);
+    size_t maxArea = static_cast<size_t>(packer->width) * packer->height;
+    typedef tuple<size_t, int, size_t> NextSize;
+    priority_queue<NextSize, vector<NextSize>, greater<NextSize>> sizes;
+    for (int w : widths)
+    {
+        int minHeight = static_cast<int>(min<size_t>((area + w - 1) / w, static_cast<size_t>(optHeight) + 1));
+        size_t h = lower_bound(heights.begin(), heights.end(), minHeight) - heights.begin();
+        if (h < heights.size())
+            sizes.push(make_tuple(static_cast<size_t>(w) * heights[h], w, h));
+    }
+    
+    while (!sizes.empty() && get<0>(sizes.top()) < maxArea)
+    {
+        int w = get<1>(sizes.top());
+        size_t h = get<2>(sizes.top());
+        sizes.pop();
+        if (h + 1 < heights.size())
+            sizes.push(make_tuple(static_cast<size_t>(w) * heights[h + 1], w, h + 1));
+        pair<int, int> size(w, heights[h]);
+        
+        //A size the search gives up on may still fit, so each one only gets a share of what's left of the budget,
+        //leaving the rest for the bigger sizes
+        vector<rbp::Rect> placements;
+        size_t share = budget / 4;
+        if (share < minShare)
+            break;
+        size_t left = share;
+        ExactResult found = PackExact(rects, size.first, size.second, optRotate, left, placements);
+        budget -= share - left;
+        if (found != ExactResult::Packed)
+            continue;
+        
+        auto result = new Packer(size.first, size.second, optPadding, optAlign);
+        result->bitmaps = packer->bitmaps;
+        result->points = packer->points;
+        result->dupLookup = packer->dupLookup;
+        for (size_t i = 0; i < originals.size(); ++i)
+        {
+            Point& p = result->points[originals[i]];
+            p.x = placements[i].x;
+            p.y = placements[i].y;
+            p.rot = optRotate && placements[i].width != rects[i].width;
+        }
+        for (auto& p : result->points)
+        {
+            if (p.dupID < 0)
+                continue;
+            const Point& original = result->points[p.dupID];
+            p.x = original.x;
+            p.y = original.y;
+            p.rot = original.rot;
+        }
+        delete packer;
+        return result;
+    }
+    return packer;
+}
+
+//Shrinks a freshly packed atlas as far as the options ask for
+static Packer* FinishPage(Packer* packer, const PackMethod& method)
+{
+    if (packer->bitmaps.empty())
+        return packer;
+    if (optMinimize >= 0)
+        packer = Minimize(packer, method);
+    if (optExact)
+        packer = PackExactly(packer);
+    return packer;
+}
+
+//Packs the bitmaps into at most the given number of atlases, first-fit decreasing: each bitmap goes into the first
+//atlas it fits in. Filling the atlases one after the other does exactly that, since an atlas is only ever changed
+//by the bitmaps that go into it. Leaves the bitmaps that didn't fit anywhere in bitmaps.
+static void PackPages(vector<Bitmap*>& bitmaps, size_t pages, const PackMethod& method, vector<Packer*>& result)
+{
+    PackMethod fill = method;
+    fill.fill = true;
+    while (!bitmaps.empty() && result.size() < pages)
+    {
+        auto packer = new Packer(optWidth, optHeight, optPadding, optAlign);
+        packer->Pack(bitmaps, false, optUnique, optRotate, fill);
+        result.push_back(packer);
+        if (packer->bitmaps.empty())
+            break;
+    }
+}
+
+//Tries to pack the sorted bitmaps into fewer atlases than the greedy packer did, down to the lower bound set by
+//their total area. Whenever a try leaves some bitmaps over, those get moved to the front of the line and it goes
+//again, so the bitmaps that are hard to place claim their space before the easy ones fill it up.
+static void Rebalance(const vector<Bitmap*>& sorted, const PackMethod& method, bool verbose, vector<Packer*>& result)
+{
+    const size_t maxRounds = 16;
+    
+    size_t area = 0;
+    for (auto bitmap : sorted)
+        area += static_cast<size_t>(GetCell(bitmap->width)) * GetCell(bitmap->height);
+    size_t pageArea = static_cast<size_t>(optWidth) * optHeight;
+    size_t lowerBound = max<size_t>(1, (area + pageArea - 1) / pageArea);
+    
+    vector<Bitmap*> order = sorted;
+    while (result.size() > lowerBound)
+    {
+        size_t pages = result.size() - 1;
+        vector<Packer*> pageResult;
+        for (size_t round = 0; round < maxRounds; ++round)
+        {
+            vector<Bitmap*> bitmaps = order;
+            PackPages(bitmaps, pages, method, pageResult);
+            if (bitmaps.empty())
+                break;
+            
+            for (auto packer : pageResult)
+                delete packer;
+            pageResult.clear();
+            
+            //The packer takes the bitmaps from the back, so the leftovers go there, keeping their sorted order
+            unordered_set<Bitmap*> leftovers(bitmaps.begin(), bitmaps.end());
+            order.erase(remove_if(order.begin(), order.end(), [&](Bitmap* bitmap) {
+                return leftovers.count(bitmap) > 0;
+            }), order.end());
+            order.insert(order.end(), bitmaps.begin(), bitmaps.end());
+        }
+        if (pageResult.empty())
+            break;
+        
+        if (verbose)
+            cout << "rebalanced into " << pageResult.size() << " atlases" << endl;
+        for (auto packer : result)
+            delete packer;
+        result = pageResult;
+        for (auto& packer : result)
+            packer = FinishPage(packer, method);
+    }
+}
+
+//Packs the bitmaps into as many atlases as it takes, starting from the back of the list. Returns the first bitmap
+//that couldn't fit, or null if they all did.
+static Bitmap* PackInOrder(vector<Bitmap*> bitmaps, const PackMethod& method, bool verbose, const string& name, vector<Packer*>& result)
+{
+    vector<Bitmap*> sorted = bitmaps;
+    while (!bitmaps.empty())
+    {
+        if (verbose)
+            cout << "packing " << bitmaps.size() << " images..." << endl;
+        auto packer = new Packer(optWidth, optHeight, optPadding, optAlign);
+        packer->Pack(bitmaps, verbose, optUnique, optRotate, method);
+        packer = FinishPage(packer, method);
+        result.push_back(packer);
+        if (verbose)
+            cout << "finished packing: " << name << to_string(result.size() - 1) << " (" << packer->width << " x " << packer->height << ')' << endl;
+        
+        if (packer->bitmaps.empty())
+            return bitmaps.back();
+    }
+    if (optRebalance && result.size() > 1)
+        Rebalance(sorted, method, verbose, result);
+    return nullptr;
+}
+
+//Packs the bitmaps into as many atlases as it takes, sorted by the method's sort order
+static Bitmap* PackBitmaps(vector<Bitmap*> bitmaps, const PackMethod& method, bool verbose, const string& name, vector<Packer*>& result)
+{
+    SortBitmaps(bitmaps, method.sort);
+    return PackInOrder(bitmaps, method, verbose, name, result);
+}
+
+static size_t GetArea(const vector<Packer*>& packers)
+{
+    size_t area = 0;
+    for (auto packer : packers)
+        area += static_cast<size_t>(packer->width) * packer->height;
+    return area;
+}
+
+static double GetMilliseconds(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+//Every combination of heuristic and sort order, plus the batch packer for each heuristic that supports it, plus
+//the guillotine and skyline heuristics that usually come out best
+static vector<PackMethod> GetPackMethods()
+{
+    const rbp::MaxRectsBinPack::FreeRectChoiceHeuristic heuristics[] = {
+        rbp::MaxRectsBinPack::RectBestShortSideFit,
+        rbp::MaxRectsBinPack::RectBestLongSideFit,
+        rbp::MaxRectsBinPack::RectBestAreaFit,
+        rbp::MaxRectsBinPack::RectBottomLeftRule,
+        rbp::MaxRectsBinPack::RectContactPointRule
+    };
+    const SortOrder sorts[] = {
+        SortOrder::Area,
+        SortOrder::MaxSide,
+        SortOrder::Width,
+        SortOrder::Height,
+        SortOrder::Perimeter
+    };
+    
+    vector<PackMethod> methods;
+    for (auto heuristic : heuristics)
+    {
+        PackMethod method;
+        method.heuristic = heuristic;
+        for (auto sort : sorts)
+        {
+            method.sort = sort;
+            methods.push_back(method);
+        }
+        
+        //The batch packer rescores everything after each placement with -CP, which is far too slow for big atlases
+        if (heuristic != rbp::MaxRectsBinPack::RectContactPointRule)
+        {
+            method.sort = SortOrder::Area;
+            method.batch = true;
+            methods.push_back(method);
+        }
+    }
+    
+    const rbp::GuillotineBinPack::FreeRectChoiceHeuristic choices[] = {
+        rbp::GuillotineBinPack::RectBestShortSideFit,
+        rbp::GuillotineBinPack::RectBestAreaFit
+    };
+    const rbp::GuillotineBinPack::GuillotineSplitHeuristic splits[] = {
+        rbp::GuillotineBinPack::SplitShorterLeftoverAxis,
+        rbp::GuillotineBinPack::SplitMinimizeArea
+    };
+    for (auto choice : choices)
+    {
+        for (auto split : splits)
+        {
+            PackMethod method;
+            method.algorithm = Algorithm::Guillotine;
+            method.guillotineChoice = choice;
+            method.guillotineSplit = split;
+            method.merge = true;
+            for (auto sort : sorts)
+            {
+                method.sort = sort;
+                methods.push_back(method);
+            }
+        }
+    }
+    
+    const rbp::SkylineBinPack::LevelChoiceHeuristic levels[] = {
+        rbp::SkylineBinPack::LevelBottomLeft,
+        rbp::SkylineBinPack::LevelMinWasteFit
+    };
+    for (auto level : levels)
+    {
+        PackMethod method;
+        method.algorithm = Algorithm::Skyline;
+        method.skylineLevel = level;
+        method.wasteMap = true;
+        for (auto sort : sorts)
+        {
+            method.sort = sort;
+            methods.push_back(method);
+        }
+    }
+    return methods;
+}
+
+//The share of the atlases' area covered by bitmaps, counting each duplicate only once
+static double GetOccupancy(const vector<Packer*>& packers)
+{
+    size_t used = 0;
+    for (auto packer : packers)
+        for (size_t i = 0; i < packer->points.size(); ++i)
+            if (packer->points[i].dupID < 0)
+                used += static_cast<size_t>(packer->bitmaps[i]->width) * packer->bitmaps[i]->height;
+    size_t area = GetArea(packers);
+    return area > 0 ? static_cast<double>(used) / area : 0.0;
+}
+
+//A packing found by --optimize-ms: the order the bitmaps were packed in, the method, and the atlases that came out
+struct Layout
+{
+    vector<Bitmap*> order;
+    PackMethod method;
+    vector<Packer*> packers;
+    double cost;
+};
+
+//Fewer atlases always come first, then a smaller total area. The bounding box of the last atlas' contents breaks
+//the ties, since it shrinks bit by bit while the atlas sizes only jump between the allowed sizes.
+static double GetCost(const vector<Packer*>& packers, size_t maxPages)
+{
+    double pageArea = static_cast<double>(optWidth) * optHeight;
+    auto last = packers.back();
+    int ww = 0;
+    int hh = 0;
+    for (size_t i = 0; i < last->points.size(); ++i)
+    {
+        const Point& p = last->points[i];
+        ww = max(ww, p.x + (p.rot ? last->bitmaps[i]->height : last->bitmaps[i]->width));
+        hh = max(hh, p.y + (p.rot ? last->bitmaps[i]->width : last->bitmaps[i]->height));
+    }
+    return packers.size() * pageArea * (maxPages + 2) + GetArea(packers) + static_cast<double>(ww) * hh;
+}
+
+//Makes a small random change to the layout: swap two bitmaps close together in the packing order, move a bitmap
+//up to be packed earlier, turn a bitmap on its side or back when rotating, or switch to another heuristic of the
+//same algorithm. Only uses the raw output of the random engine, so the same seed gives the same changes on every
+//platform.
+static void Mutate(Layout& layout, mt19937& rng)
+{
+    auto& order = layout.order;
+    auto& method = layout.method;
+    size_t n = order.size();
+    unsigned kind = rng() % 100;
+    if (kind < 60 && n > 1)
+    {
+        size_t i = rng() % n;
+        size_t j = min(n - 1, i + 1 + rng() % 8);
+        swap(order[i == j ? i - 1 : i], order[j]);
+    }
+    else if (kind < 85 && n > 1)
+    {
+        size_t i = rng() % n;
+        size_t j = i + rng() % (n - i);
+        rotate(order.begin() + i, order.begin() + i + 1, order.begin() + j + 1);
+    }
+    else if (kind < 93 && optRotate && n > 0)
+    {
+        //The batch packer picks the orientations itself, so it gets switched off to let the flip count
+        const Bitmap* bitmap = order[rng() % n];
+        auto& sideways = method.sideways;
+        auto it = lower_bound(sideways.begin(), sideways.end(), bitmap);
+        if (it != sideways.end() && *it == bitmap)
+            sideways.erase(it);
+        else
+            sideways.insert(it, bitmap);
+        method.batch = false;
+    }
+    else if (method.algorithm == Algorithm::Guillotine)
+    {
+        method.guillotineChoice = static_cast<rbp::GuillotineBinPack::FreeRectChoiceHeuristic>(rng() % 6);
+        method.guillotineSplit = static_cast<rbp::GuillotineBinPack::GuillotineSplitHeuristic>(rng() % 6);
+    }
+    else if (method.algorithm == Algorithm::Skyline)
+    {
+        method.skylineLevel = static_cast<rbp::SkylineBinPack::LevelChoiceHeuristic>(rng() % 2);
+    }
+    else
+    {
+        //The batch packer picks its own order, so it only gets switched off here, and the order takes over again
+        method.heuristic = static_cast<rbp::MaxRectsBinPack::FreeRectChoiceHeuristic>(rng() % 5);
+        method.batch = false;
+    }
+}
+
+//Searches for a denser packing than the given one until the time runs out. Every round makes a fixed number of
+//random variations of the current layout and packs them in parallel. The best of them replaces the current layout
+//if it's better, or by the simulated annealing rule if it's worse, which lets the search climb out of dead ends
+//while the temperature is still high. Each variation gets its own random engine seeded from the seed, the round
+//and its index, so the outcome only depends on the seed and the number of rounds, not on the threads.
+static void Anneal(vector<Bitmap*> sorted, const PackMethod& method, const string& name, vector<Packer*>& result)
+{
+    const size_t numCandidates = 8;
+    const double coolingRate = 0.98;
+    
+    auto start = chrono::steady_clock::now();
+    size_t maxPages = result.size();
+    double pageArea = static_cast<double>(optWidth) * optHeight;
+    double temperature = 0.02 * pageArea;
+    double occupancy = GetOccupancy(result);
+    
+    Layout current;
+    current.order = sorted;
+    current.method = method;
+    current.packers = result;
+    current.cost = GetCost(result, maxPages);
+    Layout best = current;
+    
+    size_t rounds = 0;
+    while (optRounds > 0 ? rounds < static_cast<size_t>(optRounds) : GetMilliseconds(start) < optOptimizeMs)
+    {
+        vector<Layout> candidates(numCandidates);
+        ParallelFor(numCandidates, [&](size_t i) {
+            seed_seq seq{ optSeed, static_cast<unsigned>(rounds), static_cast<unsigned>(i) };
+            mt19937 rng(seq);
+            Layout& candidate = candidates[i];
+            candidate.order = current.order;
+            candidate.method = current.method;
+            for (unsigned steps = 1 + rng() % 3; steps > 0; --steps)
+                Mutate(candidate, rng);
+            if (PackInOrder(candidate.order, candidate.method, false, name, candidate.packers) == nullptr)
+                candidate.cost = GetCost(candidate.packers, maxPages);
+            else
+                candidate.cost = numeric_limits<double>::infinity();
+        });
+        
+        size_t pick = 0;
+        for (size_t i = 1; i < numCandidates; ++i)
+            if (candidates[i].cost < candidates[pick].cost)
+                pick = i;
+        
+        seed_seq seq{ optSeed, static_cast<unsigned>(rounds), static_cast<unsigned>(numCandidates) };
+        mt19937 rng(seq);
+        double delta = candidates[pick].cost - current.cost;
+        double chance = (rng() % 1000000) / 1000000.0;
+        if (delta < 0.0 || chance < exp(-delta / temperature))
+        {
+            if (current.packers != best.packers)
+                for (auto packer : current.packers)
+                    delete packer;
+            current = candidates[pick];
+            candidates[pick].packers.clear();
+            if (current.cost < best.cost)
+            {
+                for (auto packer : best.packers)
+                    delete packer;
+                best = current;
+            }
+        }
+        for (auto& candidate : candidates)
+            for (auto packer : candidate.packers)
+                delete packer;
+        
+        temperature *= coolingRate;
+        ++rounds;
+    }
+    if (current.packers != best.packers)
+        for (auto packer : current.packers)
+            delete packer;
+    
+    result = best.packers;
+    cout << "optimized in " << rounds << " rounds with seed " << optSeed << ": " << best.method.AlgorithmToString() << ", " << result.size() << " atlases, occupancy " << (occupancy * 100.0) << "% -> " << (GetOccupancy(result) * 100.0) << '%' << endl;
+    cout << "to reproduce these atlases, pack with -R" << rounds << " -z" << optSeed << endl;
+}
+
+static bool GetPngSize(const string& file, int& width, int& height)
+{
+    vector<unsigned char> png;
+    unsigned w, h;
+    lodepng::State state;
+    if (lodepng::load_file(png, file) != 0 || png.empty() || lodepng_inspect(&w, &h, &state, png.data(), png.size()) != 0)
+        return false;
+    width = static_cast<int>(w);
+    height = static_cast<int>(h);
+    return true;
+}
+
+static void LoadInputs(const vector<string>& inputs)
+{
+    if (optVerbose)
+        cout << "loading images..." << endl;
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        if (inputs[i].rfind('.') != string::npos)
+            LoadBitmap("", inputs[i]);
+        else
+            LoadBitmaps(inputs[i], "");
+    }
+}
+
+static bool ReportValidation(const string& name, int problems, size_t atlases, size_t images)
+{
+    if (problems > 0)
+    {
+        cerr << "validation failed: " << problems << " problems in " << name << endl;
+        return false;
+    }
+    cout << "validated " << name << ": " << atlases << " atlases, " << images << " images, no problems" << endl;
+    return true;
+}
+
+//Checks where the packers put every bitmap, leaving out the duplicates, which share their original's spot
+static bool ValidatePacked(const string& name)
+{
+    int problems = 0;
+    size_t images = 0;
+    for (size_t i = 0; i < packers.size(); ++i)
+    {
+        vector<Placement> placements;
+        vector<const Bitmap*> masks;
+        for (size_t j = 0; j < packers[i]->bitmaps.size(); ++j)
+        {
+            const Bitmap* bitmap = packers[i]->bitmaps[j];
+            const Point& point = packers[i]->points[j];
+            if (point.dupID >= 0)
+                continue;
+            placements.push_back({ bitmap->name, point.x, point.y, bitmap->width, bitmap->height, point.rot });
+            if (optMethod.dense > 0)
+                masks.push_back(bitmap);
+        }
+        images += placements.size();
+        problems += ValidateAtlas(name + to_string(i), packers[i]->width, packers[i]->height, packers[i]->pad, packers[i]->align, placements, masks);
+    }
+    return ReportValidation(name, problems, packers.size(), images);
+}
+
+//Checks the atlases an earlier build saved, reading the placements back from its .json or .bin file and the atlas
+//sizes from its pngs. Densely packed atlases need their bitmaps too, so those get loaded from the inputs.
+static bool ValidateSaved(const string& outputDir, const string& name, const vector<string>& inputs)
+{
+    vector<vector<Placement>> atlases;
+    if (!LoadJson(outputDir + name + ".json", atlases) && !LoadBin(outputDir + name + ".bin", optTrim, optRotate, optArray >= 0, atlases))
+    {
+        cerr << "nothing to validate: " << name << " has no .json or .bin file" << endl;
+        return false;
+    }
+    
+    unordered_map<string, const Bitmap*> byName;
+    if (optMethod.dense > 0)
+    {
+        LoadInputs(inputs);
+        for (auto bitmap : bitmaps)
+            byName[bitmap->name] = bitmap;
+    }
+    
+    //With --array stack, the layers are stacked top to bottom in one png
+    int stackWidth = 0;
+    int stackHeight = 0;
+    bool stacked = optArray == 1 && !atlases.empty() && GetPngSize(outputDir + name + ".png", stackWidth, stackHeight);
+    if (stacked)
+        stackHeight /= static_cast<int>(atlases.size());
+    
+    int problems = 0;
+    size_t images = 0;
+    for (size_t i = 0; i < atlases.size(); ++i)
+    {
+        int width = stackWidth;
+        int height = stackHeight;
+        if (!stacked && !GetPngSize(outputDir + name + to_string(i) + ".png", width, height))
+        {
+            cerr << name << i << ": missing png" << endl;
+            ++problems;
+            continue;
+        }
+        
+        //With --unique, duplicates are saved at their original's spot, so only the first image at each spot counts
+        vector<Placement> placements;
+        vector<const Bitmap*> masks;
+        set<tuple<int, int, int, int, bool>> spots;
+        for (auto& placement : atlases[i])
+        {
+            if (optUnique && !spots.insert(make_tuple(placement.x, placement.y, placement.width, placement.height, placement.rot)).second)
+                continue;
+            placements.push_back(placement);
+            if (optMethod.dense > 0)
+            {
+                auto found = byName.find(placement.name);
+                bool matches = found != byName.end() && found->second->width == placement.width && found->second->height == placement.height;
+                masks.push_back(matches ? found->second : nullptr);
+            }
+        }
+        images += placements.size();
+        problems += ValidateAtlas(name + to_string(i), width, height, optPadding, optAlign, placements, masks);
+    }
+    return ReportValidation(name, problems, atlases.size(), images);
+}
+
+//Packs the bitmaps around the ones that can stay where the last build put them: those with the same name and size
+//as before. Only the new and resized bitmaps get packed, into the space that's left in the old atlases first, then
+//into new atlases. The old atlases keep their size, so their images only change where something moved. Returns
+//false, leaving result empty, if the atlases end up less dense compared to the last packing from scratch than
+//--incremental allows. A freshOccupancy of 0 means it isn't known, so nothing gets compared.
+static bool PackIncremental(const vector<vector<Placement>>& previous, const vector<pair<int, int>>& sizes, double freshOccupancy, const string& name, vector<Packer*>& result)
+{
+    unordered_map<string, Bitmap*> lookup;
+    for (auto bitmap : bitmaps)
+        lookup[bitmap->name] = bitmap;
+    
+    unordered_set<Bitmap*> kept;
+    for (size_t i = 0; i < previous.size(); ++i)
+    {
+        int width = sizes[i].first;
+        int height = sizes[i].second;
+        auto packer = new Packer(width, height, optPadding, optAlign);
+        for (auto& placement : previous[i])
+        {
+            auto li = lookup.find(placement.name);
+            if (li == lookup.end() || kept.count(li->second) > 0)
+                continue;
+            Bitmap* bitmap = li->second;
+            int w = GetCell(placement.rot ? bitmap->height : bitmap->width);
+            int h = GetCell(placement.rot ? bitmap->width : bitmap->height);
+            if (bitmap->width != placement.width || bitmap->height != placement.height || (placement.rot && !optRotate))
+                continue;
+            if (placement.x < 0 || placement.y < 0 || placement.x + w > width || placement.y + h > height)
+                continue;
+            if (placement.x % optAlign != 0 || placement.y % optAlign != 0)
+                continue;
+            if (packer->Keep(bitmap, placement.x, placement.y, placement.rot, optUnique))
+                kept.insert(bitmap);
+        }
+        result.push_back(packer);
+    }
+    
+    vector<Bitmap*> rest;
+    for (auto bitmap : bitmaps)
+        if (kept.count(bitmap) == 0)
+            rest.push_back(bitmap);
+    size_t numNew = rest.size();
+    SortBitmaps(rest, optMethod.sort);
+    
+    //Fill the gaps in the old atlases, keeping their size even if the new contents would fit in a smaller one
+    PackMethod fill = optMethod;
+    fill.fill = true;
+    for (auto& packer : result)
+    {
+        int width = packer->width;
+        int height = packer->height;
+        if (!rest.empty())
+            packer->Pack(rest, optVerbose, optUnique, optRotate, fill);
+        packer->width = width;
+        packer->height = height;
+    }
+    
+    //Drop the atlases that were left empty, everything in them changed or is gone
+    result.erase(remove_if(result.begin(), result.end(), [](Packer* packer) {
+        if (!packer->bitmaps.empty())
+            return false;
+        delete packer;
+        return true;
+    }), result.end());
+    
+    Bitmap* failed = rest.empty() ? nullptr : PackInOrder(rest, optMethod, optVerbose, name, result);
+    
+    //Compare against the last build that packed from scratch, rather than packing everything again just to see
+    double occupancy = GetOccupancy(result);
+    if (failed != nullptr || occupancy * 100.0 < freshOccupancy * optIncremental)
+    {
+        if (failed == nullptr)
+            cout << "occupancy dropped to " << (occupancy * 100.0) << "% against " << (freshOccupancy * 100.0) << "% from scratch, repacking" << endl;
+        for (auto packer : result)
+            delete packer;
+        result.clear();
+        return false;
+    }
+    
+    cout << "kept " << (bitmaps.size() - numNew) << " images in place, packed " << numNew << " (" << result.size() << " atlases, occupancy " << (occupancy * 100.0) << "%)" << endl;
+    return true;
+}
+
+//The size of the area the bitmaps in an atlas cover, padding included
+static void GetUsedSize(const Packer* packer, int& ww, int& hh)
+{
+    ww = 0;
+    hh = 0;
+    for (size_t i = 0; i < packer->points.size(); ++i)
+    {
+        const Point& p = packer->points[i];
+        Bitmap* bitmap = packer->bitmaps[i];
+        ww = max(ww, p.x + packer->GetCellSize(p.rot ? bitmap->height : bitmap->width));
+        hh = max(hh, p.y + packer->GetCellSize(p.rot ? bitmap->width : bitmap->height));
+    }
+}
+
+//A block holding a single bitmap, for the bitmaps that get packed loose
+static Packer* GetLooseBlock(Bitmap* bitmap)
+{
+    auto block = new Packer(GetCell(bitmap->width), GetCell(bitmap->height), optPadding, optAlign);
+    Point p;
+    p.x = 0;
+    p.y = 0;
+    p.dupID = -1;
+    p.rot = false;
+    block->points.push_back(p);
+    block->bitmaps.push_back(bitmap);
+    return block;
+}
+
+//Packs every folder into blocks of its own, all at once, then packs the blocks into atlases without ever splitting
+//one up, so the bitmaps of a folder (like the frames of an animation) end up next to each other. Blocks that come
+//out less dense than --hierarchy allows are broken up and their bitmaps packed loose. Returns the first bitmap that
+//couldn't fit, or null if they all did.
+static Bitmap* PackHierarchy(const string& name, vector<Packer*>& result)
+{
+    //Group the bitmaps by the folder LoadBitmaps found them in
+    map<string, vector<Bitmap*>> folders;
+    for (auto bitmap : bitmaps)
+    {
+        size_t slash = bitmap->name.rfind('/');
+        folders[slash == string::npos ? "" : bitmap->name.substr(0, slash)].push_back(bitmap);
+    }
+    vector<vector<Bitmap*>*> groups;
+    for (auto& folder : folders)
+        groups.push_back(&folder.second);
+    
+    //Pack each folder into as few blocks as it takes, then cut each block down to what it uses
+    vector<vector<Packer*>> groupBlocks(groups.size());
+    vector<Bitmap*> failed(groups.size());
+    ParallelFor(groups.size(), [&](size_t i) {
+        vector<Packer*>& blocks = groupBlocks[i];
+        failed[i] = PackBitmaps(*groups[i], optMethod, false, name, blocks);
+        if (failed[i] != nullptr)
+            return;
+        
+        size_t used = 0;
+        size_t area = 0;
+        for (auto block : blocks)
+        {
+            for (size_t j = 0; j < block->points.size(); ++j)
+                if (block->points[j].dupID < 0)
+                    used += static_cast<size_t>(GetCell(block->bitmaps[j]->width)) * GetCell(block->bitmaps[j]->height);
+            GetUsedSize(block, block->width, block->height);
+            area += static_cast<size_t>(block->width) * block->height;
+        }
+        
+        if (used * 100 < area * optHierarchy)
+        {
+            for (auto block : blocks)
+                delete block;
+            blocks.clear();
+            for (auto bitmap : *groups[i])
+                blocks.push_back(GetLooseBlock(bitmap));
+        }
+    });
+    
+    vector<Packer*> blocks;
+    for (auto& group : groupBlocks)
+        blocks.insert(blocks.end(), group.begin(), group.end());
+    for (auto bitmap : failed)
+    {
+        if (bitmap != nullptr)
+        {
+            for (auto block : blocks)
+                delete block;
+            return bitmap;
+        }
+    }
+    
+    //Biggest blocks first. The sort is stable so that equal blocks stay in folder order.
+    stable_sort(blocks.begin(), blocks.end(), [](const Packer* a, const Packer* b) {
+        return static_cast<size_t>(a->width) * a->height > static_cast<size_t>(b->width) * b->height;
+    });
+    
+    //Fill one atlas after the other with whichever blocks still fit in it. Blocks only get rotated if they hold
+    //a single bitmap, since the bitmaps in a rotated block would have to turn twice.
+    auto heuristic = optMethod.algorithm == Algorithm::MaxRects ? optMethod.heuristic : rbp::MaxRectsBinPack::RectBestShortSideFit;
+    while (!blocks.empty())
+    {
+        if (optVerbose)
+            cout << "packing " << blocks.size() << " blocks..." << endl;
+        
+        auto packer = new Packer(optWidth, optHeight, optPadding, optAlign);
+        rbp::MaxRectsBinPack bin(optWidth, optHeight);
+        vector<Packer*> skipped;
+        int ww = 0;
+        int hh = 0;
+        for (auto block : blocks)
+        {
+            bool single = block->bitmaps.size() == 1;
+            rbp::Rect rect = bin.Insert(block->width, block->height, optRotate && single, heuristic);
+            if (rect.width == 0 || rect.height == 0)
+            {
+                skipped.push_back(block);
+                continue;
+            }
+            
+            int base = static_cast<int>(packer->points.size());
+            for (size_t j = 0; j < block->points.size(); ++j)
+            {
+                Point p = block->points[j];
+                p.x += rect.x;
+                p.y += rect.y;
+                if (single && rect.width != block->width)
+                    p.rot = !p.rot;
+                if (p.dupID >= 0)
+                    p.dupID += base;
+                packer->points.push_back(p);
+                packer->bitmaps.push_back(block->bitmaps[j]);
+            }
+            ww = max(ww, rect.x + rect.width);
+            hh = max(hh, rect.y + rect.height);
+            delete block;
+        }
+        
+        while (packer->width / 2 >= ww)
+            packer->width /= 2;
+        while (packer->height / 2 >= hh)
+            packer->height /= 2;
+        result.push_back(packer);
+        if (optVerbose)
+            cout << "finished packing: " << name << to_string(result.size() - 1) << " (" << packer->width << " x " << packer->height << ')' << endl;
+        blocks = skipped;
+    }
+    return nullptr;
+}
+
+//Reads a usage file: each line lists the names of bitmaps that get drawn together, separated by spaces. Empty
+//lines and lines starting with # are skipped.
+static vector<vector<Bitmap*>> LoadUsage(const string& file)
+{
+    ifstream usage(file);
+    if (!usage)
+    {
+        cerr << "failed to open usage file: " << file << endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    unordered_map<string, Bitmap*> lookup;
+    for (auto bitmap : bitmaps)
+        lookup[bitmap->name] = bitmap;
+    
+    vector<vector<Bitmap*>> groups;
+    string line;
+    while (getline(usage, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        vector<Bitmap*> group;
+        stringstream names(line);
+        string name;
+        while (names >> name)
+        {
+            auto li = lookup.find(name);
+            if (li != lookup.end())
+                group.push_back(li->second);
+            else
+                cerr << "unknown image in usage file: " << name << endl;
+        }
+        if (!group.empty())
+            groups.push_back(group);
+    }
+    return groups;
+}
+
+//How many times drawing the bitmaps of each group in order switches from one atlas to another, on average
+static double GetSwitches(const vector<vector<Bitmap*>>& groups, const vector<Packer*>& packers, vector<size_t>& switches)
+{
+    unordered_map<Bitmap*, size_t> atlases;
+    for (size_t i = 0; i < packers.size(); ++i)
+        for (auto bitmap : packers[i]->bitmaps)
+            atlases[bitmap] = i;
+    
+    size_t total = 0;
+    switches.assign(groups.size(), 0);
+    for (size_t i = 0; i < groups.size(); ++i)
+    {
+        for (size_t j = 1; j < groups[i].size(); ++j)
+            if (atlases[groups[i][j]] != atlases[groups[i][j - 1]])
+                ++switches[i];
+        total += switches[i];
+    }
+    return groups.empty() ? 0.0 : static_cast<double>(total) / groups.size();
+}
+
+//Packs the bitmaps so that each group from the usage file ends up on as few atlases as possible. Every atlas takes
+//whole groups first, biggest first, trying each group on a copy of the atlas so that one that doesn't fit leaves
+//no trace. A group too big for any atlas is split over as few as it takes. The bitmaps that aren't in any group
+//then fill in the gaps, which keeps the atlases dense. Returns the first bitmap that couldn't fit, or null if they
+//all did.
+static Bitmap* PackGrouped(const vector<vector<Bitmap*>>& groups, const string& name, vector<Packer*>& result)
+{
+    //A bitmap listed in more than one group goes with the first
+    unordered_set<Bitmap*> grouped;
+    vector<vector<Bitmap*>> clusters;
+    for (auto& group : groups)
+    {
+        vector<Bitmap*> cluster;
+        for (auto bitmap : group)
+            if (grouped.insert(bitmap).second)
+                cluster.push_back(bitmap);
+        if (cluster.empty())
+            continue;
+        SortBitmaps(cluster, optMethod.sort);
+        clusters.push_back(cluster);
+    }
+    stable_sort(clusters.begin(), clusters.end(), [](const vector<Bitmap*>& a, const vector<Bitmap*>& b) {
+        size_t areaA = 0;
+        size_t areaB = 0;
+        for (auto bitmap : a)
+            areaA += static_cast<size_t>(bitmap->width) * bitmap->height;
+        for (auto bitmap : b)
+            areaB += static_cast<size_t>(bitmap->width) * bitmap->height;
+        return areaA > areaB;
+    });
+    
+    vector<Bitmap*> loose;
+    for (auto bitmap : bitmaps)
+        if (grouped.count(bitmap) == 0)
+            loose.push_back(bitmap);
+    SortBitmaps(loose, optMethod.sort);
+    
+    PackMethod fill = optMethod;
+    fill.fill = true;
+    vector<bool> placed(clusters.size(), false);
+    size_t numPlaced = 0;
+    while (numPlaced < clusters.size() || !loose.empty())
+    {
+        if (optVerbose)
+            cout << "packing " << (clusters.size() - numPlaced) << " groups and " << loose.size() << " images..." << endl;
+        
+        //Packing shrinks the atlas to what it uses, so it gets its full size back before every pass
+        auto packer = new Packer(optWidth, optHeight, optPadding, optAlign);
+        auto pack = [&](Packer* atlas, vector<Bitmap*>& bitmaps, bool verbose) {
+            atlas->Pack(bitmaps, verbose, optUnique, optRotate, fill);
+            atlas->width = optWidth;
+            atlas->height = optHeight;
+        };
+        
+        for (size_t i = 0; i < clusters.size(); ++i)
+        {
+            if (placed[i])
+                continue;
+            Packer trial = *packer;
+            vector<Bitmap*> cluster = clusters[i];
+            pack(&trial, cluster, false);
+            if (cluster.empty())
+            {
+                *packer = trial;
+                placed[i] = true;
+                ++numPlaced;
+            }
+        }
+        
+        if (packer->bitmaps.empty() && numPlaced < clusters.size())
+        {
+            size_t i = find(placed.begin(), placed.end(), false) - placed.begin();
+            pack(packer, clusters[i], optVerbose);
+            if (clusters[i].empty())
+            {
+                placed[i] = true;
+                ++numPlaced;
+            }
+        }
+        
+        if (!loose.empty())
+            pack(packer, loose, optVerbose);
+        
+        //Nothing fit on an empty atlas, so the first bitmap tried didn't fit anywhere. The packer takes the bitmaps
+        //from the back, and the groups went first.
+        if (packer->bitmaps.empty())
+        {
+            delete packer;
+            for (size_t i = 0; i < clusters.size(); ++i)
+                if (!placed[i] && !clusters[i].empty())
+                    return clusters[i].back();
+            return loose.empty() ? nullptr : loose.back();
+        }
+        
+        int ww, hh;
+        GetUsedSize(packer, ww, hh);
+        while (packer->width / 2 >= ww)
+            packer->width /= 2;
+        while (packer->height / 2 >= hh)
+            packer->height /= 2;
+        packer = FinishPage(packer, optMethod);
+        result.push_back(packer);
+        if (optVerbose)
+            cout << "finished packing: " << name << to_string(result.size() - 1) << " (" << packer->width << " x " << packer->height << ')' << endl;
+    }
+    return nullptr;
+}
+
 int main(int argc, const char* argv[])
 {
     //Print out passed arguments
@@ -226,8 +1522,12 @@ int main(int argc, const char* argv[])
     }
     
     //Get the options
-    optSize = 4096;
+    optWidth = 4096;
+    optHeight = 4096;
+    optMinimize = -1;
+    optExact = false;
     optPadding = 1;
+    optAlign = 1;
     optXml = false;
     optBinary = false;
     optJson = false;
@@ -236,6 +1536,17 @@ int main(int argc, const char* argv[])
     optVerbose = false;
     optForce = false;
     optUnique = false;
+    optMethod = PackMethod();
+    optOptimize = false;
+    optSortBest = false;
+    optRebalance = false;
+    optValidate = false;
+    optIncremental = -1;
+    optHierarchy = -1;
+    optArray = -1;
+    optOptimizeMs = 0;
+    optSeed = 0;
+    optRounds = 0;
     for (int i = 3; i < argc; ++i)
     {
         string arg = argv[i];
@@ -259,10 +1570,80 @@ int main(int argc, const char* argv[])
             optUnique = true;
         else if (arg == "-r" || arg == "--rotate")
             optRotate = true;
+        else if (arg == "-g" || arg == "--batch")
+            optMethod.batch = true;
+        else if (arg == "-c" || arg == "--grid")
+            optMethod.grid = true;
+        else if (arg == "-l" || arg == "--fill")
+            optMethod.fill = true;
+        else if (arg == "-o" || arg == "--optimize")
+            optOptimize = true;
+        else if (arg == "-e" || arg == "--exact")
+            optExact = true;
+        else if (arg == "-n" || arg == "--rebalance")
+            optRebalance = true;
+        else if (arg == "-V" || arg == "--validate")
+            optValidate = true;
+        else if (arg.find("--algorithm") == 0)
+            optMethod = GetAlgorithm(arg.substr(11));
+        else if (arg.find("-a") == 0)
+            optMethod = GetAlgorithm(arg.substr(2));
+        else if (arg.find("--incremental") == 0)
+            optIncremental = GetIncremental(arg.substr(13));
+        else if (arg.find("-q") == 0)
+            optIncremental = GetIncremental(arg.substr(2));
+        else if (arg.find("--array") == 0)
+            optArray = GetArray(arg.substr(7));
+        else if (arg.find("-A") == 0)
+            optArray = GetArray(arg.substr(2));
+        else if (arg.find("--usage") == 0)
+            optUsage = arg.substr(7);
+        else if (arg.find("-U") == 0)
+            optUsage = arg.substr(2);
+        else if (arg.find("--hierarchy") == 0)
+            optHierarchy = GetHierarchy(arg.substr(11));
+        else if (arg.find("-y") == 0)
+            optHierarchy = GetHierarchy(arg.substr(2));
+        else if (arg.find("--optimize-ms") == 0)
+            optOptimizeMs = GetNumber(arg.substr(13), "time");
+        else if (arg.find("-i") == 0)
+            optOptimizeMs = GetNumber(arg.substr(2), "time");
+        else if (arg.find("--seed") == 0)
+            optSeed = GetNumber(arg.substr(6), "seed");
+        else if (arg.find("-z") == 0)
+            optSeed = GetNumber(arg.substr(2), "seed");
+        else if (arg.find("--rounds") == 0)
+            optRounds = GetNumber(arg.substr(8), "rounds");
+        else if (arg.find("-R") == 0)
+            optRounds = GetNumber(arg.substr(2), "rounds");
+        else if (arg.find("--sort") == 0)
+            optMethod.sort = GetSort(arg.substr(6));
+        else if (arg.find("-k") == 0)
+            optMethod.sort = GetSort(arg.substr(2));
         else if (arg.find("--size") == 0)
-            optSize = GetPackSize(arg.substr(6));
+            optWidth = optHeight = GetPackSize(arg.substr(6));
         else if (arg.find("-s") == 0)
-            optSize = GetPackSize(arg.substr(2));
+            optWidth = optHeight = GetPackSize(arg.substr(2));
+        else if (arg.find("--max-width") == 0)
+            optWidth = GetMaxSize(arg.substr(11));
+        else if (arg.find("-w") == 0)
+            optWidth = GetMaxSize(arg.substr(2));
+        else if (arg.find("--max-height") == 0)
+            optHeight = GetMaxSize(arg.substr(12));
+        else if (arg.find("-h") == 0)
+            optHeight = GetMaxSize(arg.substr(2));
+        else if (arg.find("--minimize") == 0)
+            optMinimize = GetMinimize(arg.substr(10));
+        else if (arg.find("-m") == 0)
+            optMinimize = GetMinimize(arg.substr(2));
+        else if (arg.find("--dense") == 0)
+            optMethod.dense = GetDense(arg.substr(7));
+        else if (arg.find("-D") == 0)
+            optMethod.dense = GetDense(arg.substr(2));
+        else if (arg.find("--align") == 0)
+            optAlign = GetAlign(arg.substr(7));
+        else if (arg.find("-B") == 0)
+            optAlign = GetAlign(arg.substr(2));
         else if (arg.find("--pad") == 0)
             optPadding = GetPadding(arg.substr(5));
         else if (arg.find("-p") == 0)
@@ -273,11 +1654,32 @@ int main(int argc, const char* argv[])
             return EXIT_FAILURE;
         }
     }
+    if (optMethod.batch && optMethod.algorithm == Algorithm::Skyline)
+    {
+        cerr << "--batch only works with the maxrects and guillotine algorithms" << endl;
+        return EXIT_FAILURE;
+    }
+    if (optMethod.dense > 0 && (optMethod.batch || optMethod.grid || optAlign > 1))
+    {
+        cerr << "--dense doesn't work with --batch, --grid or --align" << endl;
+        return EXIT_FAILURE;
+    }
+    if ((optIncremental >= 0 || !optUsage.empty()) && optMethod.algorithm != Algorithm::MaxRects && optMethod.dense == 0)
+    {
+        cerr << "--incremental and --usage only work with the maxrects algorithm, which can pack around the images already placed" << endl;
+        return EXIT_FAILURE;
+    }
+    if (optHierarchy >= 0 && (optMinimize >= 0 || optExact || optOptimizeMs > 0 || optRounds > 0))
+    {
+        cerr << "--hierarchy doesn't work with --minimize, --exact, --optimize-ms or --rounds" << endl;
+        return EXIT_FAILURE;
+    }
     
-    //Hash the arguments and input directories
+    //Hash the arguments and input directories. Validating doesn't change the output, so it's left out.
     size_t newHash = 0;
     for (int i = 1; i < argc; ++i)
-        HashString(newHash, argv[i]);
+        if (string(argv[i]) != "-V" && string(argv[i]) != "--validate")
+            HashString(newHash, argv[i]);
     for (size_t i = 0; i < inputs.size(); ++i)
     {
         if (inputs[i].rfind('.') == string::npos)
@@ -285,13 +1687,18 @@ int main(int argc, const char* argv[])
         else
             HashFile(newHash, inputs[i]);
     }
+    if (!optUsage.empty())
+        HashFile(newHash, optUsage);
     
     //Load the old hash
     size_t oldHash;
-    if (LoadHash(oldHash, outputDir + name + ".hash"))
+    double freshOccupancy = 0.0;
+    if (LoadHash(oldHash, freshOccupancy, outputDir + name + ".hash"))
     {
         if (!optForce && newHash == oldHash)
         {
+            if (optValidate)
+                return ValidateSaved(outputDir, name, inputs) ? EXIT_SUCCESS : EXIT_FAILURE;
             cout << "atlas is unchanged: " << name << endl;
             return EXIT_SUCCESS;
         }
@@ -307,8 +1714,29 @@ int main(int argc, const char* argv[])
     -f  --force             ignore the hash, forcing the packer to repack
     -u  --unique            remove duplicate bitmaps from the atlas
     -r  --rotate            enabled rotating bitmaps 90 degrees clockwise when packing
-    -s# --size#             max atlas size (# can be 4096, 2048, 1024, 512, or 256)
-    -p# --pad#              padding between images (# can be from 0 to 16)*/
+    -g  --batch             pack whichever bitmap fits best next instead of going from largest to smallest
+    -a# --algorithm#        packing algorithm (# can be maxrects, guillotine, or skyline, see below)
+    -k# --sort#             order to pack the bitmaps in, largest first (# can be area, max-side, width, height, perimeter, or best to try them all)
+    -c  --grid              lay out runs of same-sized bitmaps in grids, then pack the rest around them
+    -l  --fill              keep filling an atlas with smaller bitmaps after one doesn't fit
+    -o  --optimize          try every heuristic and sort order at once, keeping the one with the smallest atlases
+    -n  --rebalance         spread the bitmaps over all the atlases at once, trying to get by with fewer of them
+    -y# --hierarchy#        pack each folder into a block of its own in parallel, then the blocks into atlases (folders whose block is less than # percent full get packed loose, # defaults to 60)
+    -U# --usage#            keep the groups of bitmaps listed in file # on as few atlases as possible (one group per line, names separated by spaces)
+    -A# --array#            give every atlas the same size so they can be loaded as the layers of one array texture, and save each image's layer (# can be stack to save all the layers in one png, top to bottom)
+    -q# --incremental#      keep the bitmaps that didn't change where the last build put them, packing only new and resized ones around them (repacks from scratch if that comes out less than # percent as dense as the last build that packed from scratch, # defaults to 80)
+    -i# --optimize-ms#      spend # milliseconds searching for a denser packing with random variations of the packing order, the orientations (with --rotate) and the heuristic
+    -z# --seed#             seed for --optimize-ms and --rounds, the same seed and number of rounds always give the same atlases (# defaults to 0)
+    -R# --rounds#           search for a denser packing like --optimize-ms, but for exactly # rounds instead of a time limit, so the atlases can be reproduced
+    -s# --size#             max atlas size (# can be 32768, 16384, 8192, 4096, 2048, 1024, 512, or 256)
+    -w# --max-width#        max atlas width (# can be from 1 to 32768)
+    -h# --max-height#       max atlas height (# can be from 1 to 32768)
+    -m# --minimize#         search for the smallest size each atlas fits in (# can be pot for powers of two, or 1 or 4 for multiples of that)
+    -e  --exact             search exhaustively for a smaller size for atlases of up to 200 bitmaps, keeping the packer's size if it takes too long
+    -p# --pad#              padding between images (# can be from 0 to 16)
+    -B# --align#            snap the images to multiples of # pixels for block compression, extruding their edge pixels into the gaps (# can be from 1 to 16, # defaults to 4)
+    -D# --dense#            pack the images by their alpha channel on a grid of # pixel cells instead of by their bounding boxes, letting them interlock with --pad cells kept clear around their visible pixels (# can be from 1 to 16, # defaults to 4)
+    -V  --validate          check that no images overlap, come closer than --pad allows, or stick out of their atlas, failing if any do (checks the saved atlases if they're up to date)*/
     
     if (optVerbose)
     {
@@ -322,8 +1750,46 @@ int main(int argc, const char* argv[])
         cout << "\t--force: " << (optForce ? "true" : "false") << endl;
         cout << "\t--unique: " << (optUnique ? "true" : "false") << endl;
         cout << "\t--rotate: " << (optRotate ? "true" : "false") << endl;
-        cout << "\t--size: " << optSize << endl;
+        cout << "\t--batch: " << (optMethod.batch ? "true" : "false") << endl;
+        cout << "\t--algorithm: " << optMethod.AlgorithmToString() << endl;
+        cout << "\t--sort: " << (optSortBest ? "best" : optMethod.SortToString()) << endl;
+        cout << "\t--grid: " << (optMethod.grid ? "true" : "false") << endl;
+        cout << "\t--fill: " << (optMethod.fill ? "true" : "false") << endl;
+        cout << "\t--optimize: " << (optOptimize ? "true" : "false") << endl;
+        cout << "\t--rebalance: " << (optRebalance ? "true" : "false") << endl;
+        cout << "\t--usage: " << optUsage << endl;
+        cout << "\t--array: " << (optArray < 0 ? "false" : optArray == 0 ? "true" : "stack") << endl;
+        cout << "\t--hierarchy: " << (optHierarchy < 0 ? "false" : to_string(optHierarchy)) << endl;
+        cout << "\t--incremental: " << (optIncremental < 0 ? "false" : to_string(optIncremental)) << endl;
+        cout << "\t--optimize-ms: " << optOptimizeMs << endl;
+        cout << "\t--seed: " << optSeed << endl;
+        cout << "\t--rounds: " << optRounds << endl;
+        cout << "\t--max-width: " << optWidth << endl;
+        cout << "\t--max-height: " << optHeight << endl;
+        cout << "\t--minimize: " << (optMinimize < 0 ? "false" : optMinimize == 0 ? "pot" : to_string(optMinimize)) << endl;
+        cout << "\t--exact: " << (optExact ? "true" : "false") << endl;
         cout << "\t--pad: " << optPadding << endl;
+        cout << "\t--align: " << optAlign << endl;
+        cout << "\t--dense: " << optMethod.dense << endl;
+        cout << "\t--validate: " << (optValidate ? "true" : "false") << endl;
+    }
+    
+    //Read back where the last build put everything, before its files get removed
+    vector<vector<Placement>> previous;
+    vector<pair<int, int>> previousSizes;
+    if (optIncremental >= 0)
+    {
+        if (!LoadJson(outputDir + name + ".json", previous) && !LoadBin(outputDir + name + ".bin", optTrim, optRotate, optArray >= 0, previous))
+            previous.clear();
+        for (size_t i = 0; i < previous.size(); ++i)
+        {
+            int w = optWidth;
+            int h = optHeight;
+            GetPngSize(outputDir + name + to_string(i) + ".png", w, h);
+            previousSizes.push_back(make_pair(min(w, optWidth), min(h, optHeight)));
+        }
+        if (optVerbose)
+            cout << "previous build: " << previous.size() << " atlases" << endl;
     }
     
     //Remove old files
@@ -331,49 +1797,187 @@ int main(int argc, const char* argv[])
     RemoveFile(outputDir + name + ".bin");
     RemoveFile(outputDir + name + ".xml");
     RemoveFile(outputDir + name + ".json");
+    RemoveFile(outputDir + name + ".png");
     for (size_t i = 0; i < 16; ++i)
         RemoveFile(outputDir + name + to_string(i) + ".png");
     
     //Load the bitmaps from all the input files and directories
-    if (optVerbose)
-        cout << "loading images..." << endl;
-    for (size_t i = 0; i < inputs.size(); ++i)
-    {
-        if (inputs[i].rfind('.') != string::npos)
-            LoadBitmap("", inputs[i]);
-        else
-            LoadBitmaps(inputs[i], "");
-    }
-    
-    //Sort the bitmaps by area
-    sort(bitmaps.begin(), bitmaps.end(), [](const Bitmap* a, const Bitmap* b) {
-        return (a->width * a->height) < (b->width * b->height);
-    });
+    LoadInputs(inputs);
     
     //Pack the bitmaps
-    while (!bitmaps.empty())
+    PackMethod packedWith = optMethod;
+    vector<PackMethod> methods;
+    if (optOptimize)
+    {
+        methods = GetPackMethods();
+        for (auto& method : methods)
+        {
+            method.grid = optMethod.grid;
+            method.fill = optMethod.fill;
+            method.dense = optMethod.dense;
+        }
+    }
+    else if (optSortBest)
+    {
+        for (int sort = 0; sort < 5; ++sort)
+        {
+            methods.push_back(optMethod);
+            methods.back().sort = static_cast<SortOrder>(sort);
+        }
+    }
+    bool incremental = !previous.empty() && PackIncremental(previous, previousSizes, freshOccupancy, name, packers);
+    if (incremental)
     {
         if (optVerbose)
-            cout << "packing " << bitmaps.size() << " images..." << endl;
-        auto packer = new Packer(optSize, optSize, optPadding);
-        packer->Pack(bitmaps, optVerbose, optUnique, optRotate);
-        packers.push_back(packer);
+            cout << "packed incrementally with " << optMethod.ToString() << endl;
+    }
+    else if (!optUsage.empty())
+    {
+        vector<vector<Bitmap*>> groups = LoadUsage(optUsage);
+        Bitmap* failed = PackGrouped(groups, name, packers);
+        if (failed != nullptr)
+        {
+            cerr << "packing failed, could not fit bitmap: " << failed->name << endl;
+            return EXIT_FAILURE;
+        }
+        
+        //Compare against packing without the groups
+        vector<Packer*> ungrouped;
+        PackBitmaps(bitmaps, optMethod, false, name, ungrouped);
+        vector<size_t> before;
+        vector<size_t> after;
+        double switchesBefore = GetSwitches(groups, ungrouped, before);
+        double switchesAfter = GetSwitches(groups, packers, after);
         if (optVerbose)
-            cout << "finished packing: " << name << to_string(packers.size() - 1) << " (" << packer->width << " x " << packer->height << ')' << endl;
-    
-        if (packer->bitmaps.empty())
         {
-            cerr << "packing failed, could not fit bitmap: " << (bitmaps.back())->name << endl;
+            for (size_t i = 0; i < groups.size(); ++i)
+                cout << "\tgroup " << i << " (" << groups[i].size() << " images): " << before[i] << " -> " << after[i] << " texture switches" << endl;
+        }
+        cout << "texture switches per group: " << switchesBefore << " -> " << switchesAfter << " (" << ungrouped.size() << " -> " << packers.size() << " atlases)" << endl;
+        for (auto packer : ungrouped)
+            delete packer;
+    }
+    else if (optHierarchy >= 0)
+    {
+        auto start = chrono::steady_clock::now();
+        Bitmap* failed = PackHierarchy(name, packers);
+        if (failed != nullptr)
+        {
+            cerr << "packing failed, could not fit bitmap: " << failed->name << endl;
             return EXIT_FAILURE;
         }
+        if (optVerbose)
+            cout << "packed folders with " << optMethod.ToString() << " in " << GetMilliseconds(start) << " ms" << endl;
+    }
+    else if (!methods.empty())
+    {
+        //Every method packs its own copy of the bitmaps on its own thread
+        vector<vector<Packer*>> results(methods.size());
+        vector<Bitmap*> failed(methods.size());
+        vector<double> times(methods.size());
+        if (optVerbose)
+            cout << "packing " << bitmaps.size() << " images with " << methods.size() << " methods..." << endl;
+        ParallelFor(methods.size(), [&](size_t i) {
+            auto start = chrono::steady_clock::now();
+            failed[i] = PackBitmaps(bitmaps, methods[i], false, name, results[i]);
+            times[i] = GetMilliseconds(start);
+        });
+        
+        //Keep the fewest atlases, then the smallest total area. Ties go to the earliest method, so the choice
+        //never depends on which thread finished first.
+        int best = -1;
+        size_t bestArea = 0;
+        for (size_t i = 0; i < methods.size(); ++i)
+        {
+            if (failed[i] != nullptr)
+                continue;
+            size_t area = GetArea(results[i]);
+            if (optVerbose)
+                cout << '\t' << methods[i].ToString() << ": " << results[i].size() << " atlases, " << area << " pixels, " << times[i] << " ms" << endl;
+            if (best < 0 || results[i].size() < results[best].size() || (results[i].size() == results[best].size() && area < bestArea))
+            {
+                best = static_cast<int>(i);
+                bestArea = area;
+            }
+        }
+        
+        for (size_t i = 0; i < methods.size(); ++i)
+        {
+            if (static_cast<int>(i) == best)
+                continue;
+            for (auto packer : results[i])
+                delete packer;
+        }
+        
+        if (best < 0)
+        {
+            cerr << "packing failed, could not fit bitmap: " << failed[0]->name << endl;
+            return EXIT_FAILURE;
+        }
+        
+        packers = results[best];
+        packedWith = methods[best];
+        cout << "packed with " << methods[best].ToString() << " (" << packers.size() << " atlases, " << bestArea << " pixels, " << times[best] << " ms)" << endl;
+    }
+    else
+    {
+        auto start = chrono::steady_clock::now();
+        Bitmap* failed = PackBitmaps(bitmaps, optMethod, optVerbose, name, packers);
+        if (failed != nullptr)
+        {
+            cerr << "packing failed, could not fit bitmap: " << failed->name << endl;
+            return EXIT_FAILURE;
+        }
+        if (optVerbose)
+            cout << "packed with " << optMethod.ToString() << " in " << GetMilliseconds(start) << " ms" << endl;
+    }
+    
+    //Search for a denser packing, starting from the best one so far
+    if ((optOptimizeMs > 0 || optRounds > 0) && !incremental && optUsage.empty())
+    {
+        vector<Bitmap*> sorted = bitmaps;
+        SortBitmaps(sorted, packedWith.sort);
+        Anneal(sorted, packedWith, name, packers);
     }
     
+    //An array texture needs every layer at the same size, so the atlases all grow to fit the biggest one
+    if (optArray >= 0)
+    {
+        int arrayWidth = 0;
+        int arrayHeight = 0;
+        for (auto packer : packers)
+        {
+            arrayWidth = max(arrayWidth, packer->width);
+            arrayHeight = max(arrayHeight, packer->height);
+        }
+        for (auto packer : packers)
+        {
+            packer->width = arrayWidth;
+            packer->height = arrayHeight;
+        }
+        if (optVerbose)
+            cout << "array of " << packers.size() << " layers (" << arrayWidth << " x " << arrayHeight << ')' << endl;
+    }
+    
+    //Check the atlases before anything gets saved
+    if (optValidate && !ValidatePacked(name))
+        return EXIT_FAILURE;
+    
     //Save the atlas image
-    for (size_t i = 0; i < packers.size(); ++i)
+    if (optArray == 1 && !packers.empty())
     {
         if (optVerbose)
-            cout << "writing png: " << outputDir << name << to_string(i) << ".png" << endl;
-        packers[i]->SavePng(outputDir + name + to_string(i) + ".png");
+            cout << "writing png: " << outputDir << name << ".png" << endl;
+        SavePng(outputDir + name + ".png", packers, optMethod.dense > 0);
+    }
+    else
+    {
+        for (size_t i = 0; i < packers.size(); ++i)
+        {
+            if (optVerbose)
+                cout << "writing png: " << outputDir << name << to_string(i) << ".png" << endl;
+            packers[i]->SavePng(outputDir + name + to_string(i) + ".png", optMethod.dense > 0);
+        }
     }
     
     //Save the atlas binary
@@ -383,9 +1987,9 @@ int main(int argc, const char* argv[])
             cout << "writing bin: " << outputDir << name << ".bin" << endl;
         
         ofstream bin(outputDir + name + ".bin", ios::binary);
-        WriteShort(bin, (int16_t)packers.size());
+        WriteInt(bin, static_cast<int>(packers.size()));
         for (size_t i = 0; i < packers.size(); ++i)
-            packers[i]->SaveBin(name + to_string(i), bin, optTrim, optRotate);
+            packers[i]->SaveBin(name + to_string(i), bin, optTrim, optRotate, optArray >= 0 ? static_cast<int>(i) : -1);
         bin.close();
     }
     
@@ -398,7 +2002,7 @@ int main(int argc, const char* argv[])
         ofstream xml(outputDir + name + ".xml");
         xml << "<atlas>" << endl;
         for (size_t i = 0; i < packers.size(); ++i)
-            packers[i]->SaveXml(name + to_string(i), xml, optTrim, optRotate);
+            packers[i]->SaveXml(name + to_string(i), xml, optTrim, optRotate, optArray >= 0 ? static_cast<int>(i) : -1);
         xml << "</atlas>";
     }
     
@@ -414,7 +2018,7 @@ int main(int argc, const char* argv[])
         for (size_t i = 0; i < packers.size(); ++i)
         {
             json << "\t\t{" << endl;
-            packers[i]->SaveJson(name + to_string(i), json, optTrim, optRotate);
+            packers[i]->SaveJson(name + to_string(i), json, optTrim, optRotate, optArray >= 0 ? static_cast<int>(i) : -1);
             json << "\t\t}";
             if (i + 1 < packers.size())
                 json << ',';
@@ -425,7 +2029,7 @@ int main(int argc, const char* argv[])
     }
     
     //Save the new hash
-    SaveHash(newHash, outputDir + name + ".hash");
+    SaveHash(newHash, incremental ? freshOccupancy : GetOccupancy(packers), outputDir + name + ".hash");
     
     return EXIT_SUCCESS;
 }
@@ -28,25 +28,442 @@
 #include "MaxRectsBinPack.h"
 #include "GuillotineBinPack.h"
 #include "binary.hpp"
+#include "png.hpp"
 #include <iostream>
 #include <algorithm>
+#include <map>
+#include <unordered_set>
+#include <cmath>
+#include <cstdlib>
+#include <mutex>
+#include <tuple>
 
 using namespace std;
 using namespace rbp;
 
-Packer::Packer(int width, int height, int pad)
-: width(width), height(height), pad(pad)
+static const char* maxRectsHeuristics[] = { "bssf", "blsf", "baf", "bl", "cp" };
+static const char* guillotineChoices[] = { "baf", "bssf", "blsf", "waf", "wssf", "wlsf" };
+static const char* guillotineSplits[] = { "slas", "llas", "minas", "maxas", "sas", "las" };
+static const char* skylineLevels[] = { "bl", "mw" };
+static const char* sortOrders[] = { "area", "max-side", "width", "height", "perimeter" };
+
+template <size_t N>
+static int FindName(const char* (&names)[N], const string& name)
+{
+    for (size_t i = 0; i < N; ++i)
+        if (name == names[i])
+            return static_cast<int>(i);
+    return -1;
+}
+
+PackMethod::PackMethod()
+: algorithm(Algorithm::MaxRects)
+, sort(SortOrder::Area)
+, heuristic(MaxRectsBinPack::RectBestShortSideFit)
+, guillotineChoice(GuillotineBinPack::RectBestAreaFit)
+, guillotineSplit(GuillotineBinPack::SplitShorterLeftoverAxis)
+, merge(false)
+, skylineLevel(SkylineBinPack::LevelBottomLeft)
+, wasteMap(false)
+, batch(false)
+, grid(false)
+, fill(false)
+, dense(0)
+{
+    
+}
+
+bool PackMethod::ParseAlgorithm(const string& str)
+{
+    vector<string> parts;
+    size_t start = 0;
+    for (size_t i = str.find('-'); i != string::npos; i = str.find('-', start))
+    {
+        parts.push_back(str.substr(start, i - start));
+        start = i + 1;
+    }
+    parts.push_back(str.substr(start));
+    
+    //Only the algorithm and its heuristics change, the rest of the options stay as they were
+    PackMethod method;
+    method.sort = sort;
+    method.batch = batch;
+    method.grid = grid;
+    method.fill = fill;
+    method.dense = dense;
+    if (parts[0] == "maxrects")
+    {
+        method.algorithm = Algorithm::MaxRects;
+        for (size_t i = 1; i < parts.size(); ++i)
+        {
+            int h = FindName(maxRectsHeuristics, parts[i]);
+            if (h < 0)
+                return false;
+            method.heuristic = static_cast<MaxRectsBinPack::FreeRectChoiceHeuristic>(h);
+        }
+    }
+    else if (parts[0] == "guillotine")
+    {
+        method.algorithm = Algorithm::Guillotine;
+        for (size_t i = 1; i < parts.size(); ++i)
+        {
+            int choice = FindName(guillotineChoices, parts[i]);
+            int split = FindName(guillotineSplits, parts[i]);
+            if (choice >= 0)
+                method.guillotineChoice = static_cast<GuillotineBinPack::FreeRectChoiceHeuristic>(choice);
+            else if (split >= 0)
+                method.guillotineSplit = static_cast<GuillotineBinPack::GuillotineSplitHeuristic>(split);
+            else if (parts[i] == "merge")
+                method.merge = true;
+            else
+                return false;
+        }
+    }
+    else if (parts[0] == "skyline")
+    {
+        method.algorithm = Algorithm::Skyline;
+        for (size_t i = 1; i < parts.size(); ++i)
+        {
+            int level = FindName(skylineLevels, parts[i]);
+            if (level >= 0)
+                method.skylineLevel = static_cast<SkylineBinPack::LevelChoiceHeuristic>(level);
+            else if (parts[i] == "wastemap")
+                method.wasteMap = true;
+            else
+                return false;
+        }
+    }
+    else
+        return false;
+    
+    *this = method;
+    return true;
+}
+
+bool PackMethod::ParseSort(const string& str)
+{
+    int order = FindName(sortOrders, str);
+    if (order < 0)
+        return false;
+    sort = static_cast<SortOrder>(order);
+    return true;
+}
+
+string PackMethod::SortToString() const
+{
+    return sortOrders[static_cast<int>(sort)];
+}
+
+string PackMethod::AlgorithmToString() const
+{
+    if (algorithm == Algorithm::Guillotine)
+    {
+        string str = string("guillotine-") + guillotineChoices[guillotineChoice] + "-" + guillotineSplits[guillotineSplit];
+        return merge ? str + "-merge" : str;
+    }
+    if (algorithm == Algorithm::Skyline)
+    {
+        string str = string("skyline-") + skylineLevels[skylineLevel];
+        return wasteMap ? str + "-wastemap" : str;
+    }
+    return string("maxrects-") + maxRectsHeuristics[heuristic];
+}
+
+string PackMethod::ToString() const
+{
+    string str = AlgorithmToString();
+    if (grid)
+        str += ", grid";
+    if (fill)
+        str += ", fill";
+    if (dense > 0)
+        str += ", dense";
+    if (batch)
+        return str + ", batch";
+    switch (sort)
+    {
+        case SortOrder::Area: return str + ", sorted by area";
+        case SortOrder::MaxSide: return str + ", sorted by max side";
+        case SortOrder::Width: return str + ", sorted by width";
+        case SortOrder::Height: return str + ", sorted by height";
+        case SortOrder::Perimeter: return str + ", sorted by perimeter";
+    }
+    return str;
+}
+
+//Orders the bitmaps by key, falling back on the name when the keys are equal, so the packing never depends on
+//the order the bitmaps were loaded in
+template <class Key>
+static void SortBitmapsBy(vector<Bitmap*>& bitmaps, Key key)
+{
+    std::sort(bitmaps.begin(), bitmaps.end(), [&](const Bitmap* a, const Bitmap* b) {
+        int ka = key(a);
+        int kb = key(b);
+        return ka != kb ? ka < kb : a->name < b->name;
+    });
+}
+
+void SortBitmaps(vector<Bitmap*>& bitmaps, SortOrder sort)
+{
+    switch (sort)
+    {
+        case SortOrder::Area:
+            SortBitmapsBy(bitmaps, [](const Bitmap* b) { return b->width * b->height; });
+            break;
+        case SortOrder::MaxSide:
+            SortBitmapsBy(bitmaps, [](const Bitmap* b) { return max(b->width, b->height); });
+            break;
+        case SortOrder::Width:
+            SortBitmapsBy(bitmaps, [](const Bitmap* b) { return b->width; });
+            break;
+        case SortOrder::Height:
+            SortBitmapsBy(bitmaps, [](const Bitmap* b) { return b->height; });
+            break;
+        case SortOrder::Perimeter:
+            SortBitmapsBy(bitmaps, [](const Bitmap* b) { return b->width + b->height; });
+            break;
+    }
+}
+
+//Space in an atlas only ever gets used up, so once a size doesn't fit, nothing at least as big both ways will either
+static bool IsMisfit(const vector<RectSize>& misfits, int w, int h, bool rotate)
+{
+    if (rotate && w > h)
+        swap(w, h);
+    for (auto& misfit : misfits)
+        if (w >= misfit.width && h >= misfit.height)
+            return true;
+    return false;
+}
+
+static void AddMisfit(vector<RectSize>& misfits, int w, int h, bool rotate)
+{
+    if (rotate && w > h)
+        swap(w, h);
+    RectSize size;
+    size.width = w;
+    size.height = h;
+    misfits.push_back(size);
+}
+
+int GetCellSize(int size, int pad, int align)
+{
+    return (size + pad + align - 1) / align * align;
+}
+
+Packer::Packer(int width, int height, int pad, int align)
+: width(width), height(height), pad(pad), align(align)
 {
     
 }
 
-void Packer::Pack(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rotate)
+int Packer::GetCellSize(int size) const
 {
-    MaxRectsBinPack packer(width, height);
+    return ::GetCellSize(size, pad, align);
+}
+
+bool Packer::Keep(Bitmap* bitmap, int x, int y, bool rot, bool unique)
+{
+    Point p;
+    p.x = x;
+    p.y = y;
+    p.dupID = -1;
+    p.rot = rot;
+    
+    //Duplicates share the spot of their original
+    int dupID = unique ? FindDuplicate(bitmap) : -1;
+    if (dupID >= 0)
+    {
+        p = points[dupID];
+        p.dupID = dupID;
+    }
+    else
+    {
+        //Bitmaps that used to be duplicates may not be anymore, and can't both stay in the same spot
+        int w = GetCellSize(rot ? bitmap->height : bitmap->width);
+        int h = GetCellSize(rot ? bitmap->width : bitmap->height);
+        for (size_t i = 0; i < points.size(); ++i)
+        {
+            const Point& other = points[i];
+            if (other.dupID >= 0)
+                continue;
+            int ow = GetCellSize(other.rot ? bitmaps[i]->height : bitmaps[i]->width);
+            int oh = GetCellSize(other.rot ? bitmaps[i]->width : bitmaps[i]->height);
+            if (x < other.x + ow && other.x < x + w && y < other.y + oh && other.y < y + h)
+                return false;
+        }
+        if (unique)
+            dupLookup[bitmap->hashValue] = static_cast<int>(points.size());
+    }
+    
+    points.push_back(p);
+    this->bitmaps.push_back(bitmap);
+    return true;
+}
+
+void Packer::Pack(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rotate, const PackMethod& method)
+{
+    if (method.dense > 0)
+    {
+        PackDense(bitmaps, verbose, unique, rotate, method);
+        return;
+    }
+    
+    //Only MaxRects can pack around the bitmaps that are already in place, which is why main only allows --incremental
+    //and --usage with it
+    Algorithm algorithm = points.empty() ? method.algorithm : Algorithm::MaxRects;
+    
+    MaxRectsBinPack maxRects;
+    GuillotineBinPack guillotine;
+    SkylineBinPack skyline;
+    if (algorithm == Algorithm::Guillotine)
+        guillotine.Init(width, height);
+    else if (algorithm == Algorithm::Skyline)
+        skyline.Init(width, height, method.wasteMap);
+    else
+        maxRects.Init(width, height);
+    
+    auto insert = [&](int w, int h, bool rot) {
+        if (algorithm == Algorithm::Guillotine)
+            return guillotine.Insert(w, h, rot, method.merge, method.guillotineChoice, method.guillotineSplit);
+        if (algorithm == Algorithm::Skyline)
+            return skyline.Insert(w, h, rot, method.skylineLevel);
+        return maxRects.Insert(w, h, rot, method.heuristic);
+    };
     
     int ww = 0;
     int hh = 0;
-    while (!bitmaps.empty())
+    for (size_t i = 0; i < points.size(); ++i)
+    {
+        const Point& p = points[i];
+        if (p.dupID >= 0)
+            continue;
+        Rect rect;
+        rect.x = p.x;
+        rect.y = p.y;
+        rect.width = GetCellSize(p.rot ? this->bitmaps[i]->height : this->bitmaps[i]->width);
+        rect.height = GetCellSize(p.rot ? this->bitmaps[i]->width : this->bitmaps[i]->height);
+        maxRects.Occupy(rect);
+        ww = max(rect.x + rect.width, ww);
+        hh = max(rect.y + rect.height, hh);
+    }
+    
+    //Lay out runs of equal-sized bitmaps in grids before the rest get packed around them
+    if (method.grid)
+        PackGrids(bitmaps, verbose, unique, insert, ww, hh);
+    
+    //Global best-fit: place whichever bitmap fits best anywhere in the atlas, rather than going in sorted order
+    if (method.batch)
+    {
+        //Only one copy of each duplicate takes up space, the rest get packed along with it
+        vector<Bitmap*> packing;
+        vector<vector<Bitmap*>> dups;
+        unordered_map<size_t, int> lookup;
+        vector<RectSize> rects;
+        for (size_t i = bitmaps.size(); i-- > 0;)
+        {
+            auto bitmap = bitmaps[i];
+            if (unique)
+            {
+                int dupID = FindDuplicate(bitmap);
+                if (dupID >= 0)
+                {
+                    Point p = points[dupID];
+                    p.dupID = dupID;
+                    points.push_back(p);
+                    this->bitmaps.push_back(bitmap);
+                    continue;
+                }
+                
+                auto di = lookup.find(bitmap->hashValue);
+                if (di != lookup.end() && bitmap->Equals(packing[di->second]))
+                {
+                    dups[di->second].push_back(bitmap);
+                    continue;
+                }
+                lookup[bitmap->hashValue] = static_cast<int>(packing.size());
+            }
+            packing.push_back(bitmap);
+            dups.emplace_back();
+            RectSize size;
+            size.width = GetCellSize(bitmap->width);
+            size.height = GetCellSize(bitmap->height);
+            rects.push_back(size);
+        }
+        
+        vector<Rect> dst;
+        vector<int> order;
+        if (algorithm == Algorithm::Guillotine)
+            guillotine.Insert(rects, dst, order, rotate, method.merge, method.guillotineChoice, method.guillotineSplit);
+        else
+            maxRects.Insert(rects, dst, order, rotate, method.heuristic);
+        
+        vector<bool> packed(packing.size(), false);
+        for (size_t i = 0; i < dst.size(); ++i)
+        {
+            const Rect& rect = dst[i];
+            auto bitmap = packing[order[i]];
+            packed[order[i]] = true;
+            
+            if (verbose)
+                cout << '\t' << (dst.size() - i) << ": " << bitmap->name << endl;
+            
+            if (unique)
+                dupLookup[bitmap->hashValue] = static_cast<int>(points.size());
+            
+            Point p;
+            p.x = rect.x;
+            p.y = rect.y;
+            p.dupID = -1;
+            p.rot = rotate && rect.width != GetCellSize(bitmap->width);
+            
+            int id = static_cast<int>(points.size());
+            points.push_back(p);
+            this->bitmaps.push_back(bitmap);
+            for (auto dup : dups[order[i]])
+            {
+                p.dupID = id;
+                points.push_back(p);
+                this->bitmaps.push_back(dup);
+            }
+            
+            ww = max(rect.x + rect.width, ww);
+            hh = max(rect.y + rect.height, hh);
+        }
+        
+        //Whatever didn't fit is left for the next atlas, still in sorted order
+        bitmaps.clear();
+        for (size_t i = packing.size(); i-- > 0;)
+        {
+            if (packed[i])
+                continue;
+            for (size_t j = dups[i].size(); j-- > 0;)
+                bitmaps.push_back(dups[i][j]);
+            bitmaps.push_back(packing[i]);
+        }
+    }
+    
+    //When filling, the bitmaps that don't fit are set aside and the smaller ones after them still get a try
+    vector<Bitmap*> skipped;
+    vector<RectSize> misfits;
+    vector<RectSize> smallest;
+    bool full = false;
+    if (method.fill)
+    {
+        //smallest[i] is the smallest width and height (or short and long side) among the first i + 1 bitmaps
+        smallest.resize(bitmaps.size());
+        for (size_t i = 0; i < bitmaps.size(); ++i)
+        {
+            int w = GetCellSize(bitmaps[i]->width);
+            int h = GetCellSize(bitmaps[i]->height);
+            if (rotate && w > h)
+                swap(w, h);
+            smallest[i].width = i > 0 ? min(smallest[i - 1].width, w) : w;
+            smallest[i].height = i > 0 ? min(smallest[i - 1].height, h) : h;
+        }
+    }
+    
+    while (!method.batch && !bitmaps.empty())
     {
         auto bitmap = bitmaps.back();
         
@@ -56,11 +473,11 @@ void Packer::Pack(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rota
         //Check to see if this is a duplicate of an already packed bitmap
         if (unique)
         {
-            auto di = dupLookup.find(bitmap->hashValue);
-            if (di != dupLookup.end() && bitmap->Equals(this->bitmaps[di->second]))
+            int dupID = FindDuplicate(bitmap);
+            if (dupID >= 0)
             {
-                Point p = points[di->second];
-                p.dupID = di->second;
+                Point p = points[dupID];
+                p.dupID = dupID;
                 points.push_back(p);
                 this->bitmaps.push_back(bitmap);
                 bitmaps.pop_back();
@@ -70,10 +487,38 @@ void Packer::Pack(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rota
         
         //If it's not a duplicate, pack it into the atlas
         {
-            Rect rect = packer.Insert(bitmap->width + pad, bitmap->height + pad, rotate, MaxRectsBinPack::RectBestShortSideFit);
+            int w = GetCellSize(bitmap->width);
+            int h = GetCellSize(bitmap->height);
+            if (method.fill && (full || IsMisfit(misfits, w, h, rotate)))
+            {
+                skipped.push_back(bitmap);
+                bitmaps.pop_back();
+                continue;
+            }
+            
+            bool sideways = rotate && binary_search(method.sideways.begin(), method.sideways.end(), bitmap);
+            Rect rect = sideways ? insert(h, w, false) : insert(w, h, rotate);
             
             if (rect.width == 0 || rect.height == 0)
-                break;
+            {
+                if (!method.fill)
+                    break;
+                
+                //A bitmap that was only tried on its side might still fit upright, so it doesn't rule out anything
+                if (!sideways)
+                    AddMisfit(misfits, w, h, rotate);
+                skipped.push_back(bitmap);
+                bitmaps.pop_back();
+                
+                //Once even the smallest bitmap left won't fit, the atlas is full, and only duplicates can still go in
+                if (!bitmaps.empty() && IsMisfit(misfits, smallest[bitmaps.size() - 1].width, smallest[bitmaps.size() - 1].height, false))
+                {
+                    if (!unique)
+                        break;
+                    full = true;
+                }
+                continue;
+            }
             
             if (unique)
                 dupLookup[bitmap->hashValue] = static_cast<int>(points.size());
@@ -83,7 +528,7 @@ void Packer::Pack(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rota
             p.x = rect.x;
             p.y = rect.y;
             p.dupID = -1;
-            p.rot = rotate && bitmap->width != (rect.width - pad);
+            p.rot = rotate && rect.width != GetCellSize(bitmap->width);
             
             points.push_back(p);
             this->bitmaps.push_back(bitmap);
@@ -94,29 +539,531 @@ void Packer::Pack(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rota
         }
     }
     
+    //Whatever was set aside goes back for the next atlas, still in sorted order
+    bitmaps.insert(bitmaps.end(), skipped.rbegin(), skipped.rend());
+    
+    //Nothing fit, so there's nothing to shrink down to
+    if (this->bitmaps.empty())
+        return;
+    
     while (width / 2 >= ww)
         width /= 2;
     while( height / 2 >= hh)
         height /= 2;
 }
 
-void Packer::SavePng(const string& file)
+void Packer::PackGrids(vector<Bitmap*>& bitmaps, bool verbose, bool unique, const function<Rect(int, int, bool)>& insert, int& ww, int& hh)
+{
+    //Grids smaller than this aren't worth it, the general packer fits them in just as well
+    const size_t minGridSize = 4;
+    
+    //Group the bitmaps by size. Duplicates are left out, they get packed along with their original later on.
+    map<pair<int, int>, vector<Bitmap*>> groups;
+    unordered_map<size_t, Bitmap*> lookup;
+    for (auto bitmap : bitmaps)
+    {
+        if (unique)
+        {
+            if (FindDuplicate(bitmap) >= 0)
+                continue;
+            auto li = lookup.find(bitmap->hashValue);
+            if (li != lookup.end() && bitmap->Equals(li->second))
+                continue;
+            lookup[bitmap->hashValue] = bitmap;
+        }
+        groups[make_pair(bitmap->width, bitmap->height)].push_back(bitmap);
+    }
+    
+    //The biggest grids go in first, while there's still room for them
+    vector<vector<Bitmap*>*> runs;
+    for (auto& group : groups)
+        if (group.second.size() >= minGridSize)
+            runs.push_back(&group.second);
+    stable_sort(runs.begin(), runs.end(), [](const vector<Bitmap*>* a, const vector<Bitmap*>* b) {
+        return (*a)[0]->width * (*a)[0]->height * a->size() > (*b)[0]->width * (*b)[0]->height * b->size();
+    });
+    
+    unordered_set<Bitmap*> packed;
+    for (auto run : runs)
+    {
+        //Sort the cells by name, so that consecutive frames end up next to each other
+        sort(run->begin(), run->end(), [](const Bitmap* a, const Bitmap* b) {
+            return a->name < b->name;
+        });
+        
+        int cellW = GetCellSize((*run)[0]->width);
+        int cellH = GetCellSize((*run)[0]->height);
+        int maxCols = width / cellW;
+        int maxRows = height / cellH;
+        if (maxCols == 0 || maxRows == 0)
+            continue;
+        
+        //Make the grid as square as possible, and shrink it until it fits
+        int count = static_cast<int>(run->size());
+        int cols = static_cast<int>(ceil(sqrt(count * static_cast<double>(cellH) / cellW)));
+        cols = max(1, min(cols, maxCols));
+        int rows = min((count + cols - 1) / cols, maxRows);
+        Rect rect = Rect();
+        for (; rows > 0; rows /= 2)
+        {
+            rect = insert(cols * cellW, rows * cellH, false);
+            if (rect.width > 0 && rect.height > 0)
+                break;
+        }
+        if (rows == 0)
+            continue;
+        
+        count = min(count, rows * cols);
+        if (verbose)
+            cout << '\t' << "grid of " << count << ": " << (*run)[0]->width << " x " << (*run)[0]->height << endl;
+        for (int i = 0; i < count; ++i)
+        {
+            auto bitmap = (*run)[i];
+            if (unique)
+                dupLookup[bitmap->hashValue] = static_cast<int>(points.size());
+            
+            Point p;
+            p.x = rect.x + (i % cols) * cellW;
+            p.y = rect.y + (i / cols) * cellH;
+            p.dupID = -1;
+            p.rot = false;
+            points.push_back(p);
+            this->bitmaps.push_back(bitmap);
+            packed.insert(bitmap);
+        }
+        
+        ww = max(rect.x + rect.width, ww);
+        hh = max(rect.y + rect.height, hh);
+    }
+    
+    //Leave the rest for the general packer, still in sorted order
+    bitmaps.erase(remove_if(bitmaps.begin(), bitmaps.end(), [&](Bitmap* bitmap) {
+        return packed.count(bitmap) != 0;
+    }), bitmaps.end());
+}
+
+//The cells of a bitmap's alpha mask that have visible pixels within margin pixels of them, as runs of cells along
+//each row. The cells line up with the bitmap's top left corner, and the mask starts at cell left, top, which is
+//above and to the left of the bitmap when the margin spills over.
+struct AlphaMask
+{
+    int left;
+    int top;
+    int width;
+    int height;
+    vector<vector<pair<int, int>>> runs;
+};
+
+static AlphaMask GetAlphaMask(const Bitmap* bitmap, bool rot, int cell, int margin)
+{
+    int w = rot ? bitmap->height : bitmap->width;
+    int h = rot ? bitmap->width : bitmap->height;
+    
+    //How many pixels are visible above and to the left of each spot, so any rectangle can be checked at once
+    int stride = w + 1;
+    vector<int> counts(stride * (h + 1), 0);
+    for (int y = 0; y < h; ++y)
+    {
+        for (int x = 0; x < w; ++x)
+        {
+            uint32_t pixel = rot ? bitmap->data[(bitmap->height - 1 - x) * bitmap->width + y] : bitmap->data[y * bitmap->width + x];
+            int visible = (pixel >> 24) != 0 ? 1 : 0;
+            counts[(y + 1) * stride + x + 1] = visible + counts[y * stride + x + 1] + counts[(y + 1) * stride + x] - counts[y * stride + x];
+        }
+    }
+    
+    AlphaMask mask;
+    mask.left = -((margin + cell - 1) / cell);
+    mask.top = mask.left;
+    mask.width = (w + margin + cell - 1) / cell - mask.left;
+    mask.height = (h + margin + cell - 1) / cell - mask.top;
+    mask.runs.resize(mask.height);
+    for (int cy = 0; cy < mask.height; ++cy)
+    {
+        int y0 = max((mask.top + cy) * cell - margin, 0);
+        int y1 = min((mask.top + cy + 1) * cell + margin, h);
+        for (int cx = 0; cx < mask.width; ++cx)
+        {
+            int x0 = max((mask.left + cx) * cell - margin, 0);
+            int x1 = min((mask.left + cx + 1) * cell + margin, w);
+            bool visible = x0 < x1 && y0 < y1 && counts[y1 * stride + x1] - counts[y0 * stride + x1] - counts[y1 * stride + x0] + counts[y0 * stride + x0] > 0;
+            if (!visible)
+                continue;
+            if (!mask.runs[cy].empty() && mask.runs[cy].back().second == cx)
+                mask.runs[cy].back().second = cx + 1;
+            else
+                mask.runs[cy].push_back(make_pair(cx, cx + 1));
+        }
+    }
+    return mask;
+}
+
+//Searching for the smallest atlas size packs the same bitmaps over and over, so their masks are only built once.
+//The input bitmaps stay loaded until crunch exits, so they can be told apart by their address.
+static mutex alphaMaskMutex;
+static map<tuple<const Bitmap*, bool, int, int>, AlphaMask> alphaMasks;
+
+static const AlphaMask& GetCachedAlphaMask(const Bitmap* bitmap, bool rot, int cell, int margin)
+{
+    auto key = make_tuple(bitmap, rot, cell, margin);
+    {
+        lock_guard<mutex> lock(alphaMaskMutex);
+        auto mi = alphaMasks.find(key);
+        if (mi != alphaMasks.end())
+            return mi->second;
+    }
+    AlphaMask mask = GetAlphaMask(bitmap, rot, cell, margin);
+    lock_guard<mutex> lock(alphaMaskMutex);
+    return alphaMasks.emplace(key, move(mask)).first->second;
+}
+
+//Which cells of an atlas are taken, one bit per cell, with the rows padded out to whole words. For each row, it
+//also keeps the longest run of free cells, which rules out most spots before their bits have to be looked at.
+struct CellMap
+{
+    int cols;
+    int rows;
+    int words;
+    vector<uint64_t> bits;
+    vector<int> longestFree;
+    
+    CellMap(int cols, int rows)
+    : cols(cols), rows(rows), words((cols + 63) / 64), bits(rows * words, 0), longestFree(rows, cols)
+    {
+        
+    }
+    
+    //Takes the cells from x0 to x1 in each row from y0 to y1, clipped to the map
+    void Fill(int x0, int x1, int y0, int y1)
+    {
+        for (int y = max(y0, 0); y < min(y1, rows); ++y)
+        {
+            FillRow(y, x0, x1);
+            UpdateRow(y);
+        }
+    }
+    
+    //Takes the cells of a mask put at x, y, clipped to the map
+    void Fill(const AlphaMask& mask, int x, int y)
+    {
+        for (int r = max(0, -(y + mask.top)); r < mask.height && y + mask.top + r < rows; ++r)
+        {
+            int row = y + mask.top + r;
+            for (auto& run : mask.runs[r])
+                FillRow(row, x + mask.left + run.first, x + mask.left + run.second);
+            if (!mask.runs[r].empty())
+                UpdateRow(row);
+        }
+    }
+    
+    void FillRow(int y, int x0, int x1)
+    {
+        uint64_t* row = &bits[y * words];
+        for (int x = max(x0, 0); x < min(x1, cols); ++x)
+            row[x / 64] |= 1ull << (x % 64);
+    }
+    
+    //Finds the longest run of free cells in a row again, going a word at a time where the word is all free or all taken
+    void UpdateRow(int y)
+    {
+        const uint64_t* row = &bits[y * words];
+        int longest = 0;
+        int run = 0;
+        for (int w = 0; w < words; ++w)
+        {
+            int count = min(64, cols - w * 64);
+            if (row[w] == 0)
+                run += count;
+            else if (row[w] == ~0ull)
+                run = 0;
+            else
+            {
+                for (int b = 0; b < count; ++b)
+                {
+                    if ((row[w] >> b & 1) != 0)
+                        run = 0;
+                    else
+                        longest = max(longest, ++run);
+                }
+            }
+            longest = max(longest, run);
+        }
+        longestFree[y] = longest;
+    }
+    
+    //Whether the first count bits of a row are all set
+    static bool IsFull(const uint64_t* row, int count)
+    {
+        for (int w = 0; w < count / 64; ++w)
+            if (row[w] != ~0ull)
+                return false;
+        if (count % 64 == 0)
+            return true;
+        uint64_t last = (1ull << (count % 64)) - 1;
+        return (row[count / 64] & last) == last;
+    }
+};
+
+//dst |= src >> shift, with each holding a row of bits that starts at bit 0 of the first word. Works in place.
+static void OrShiftedDown(uint64_t* dst, const uint64_t* src, int words, int shift)
+{
+    int k = shift / 64;
+    int s = shift % 64;
+    for (int w = 0; w + k < words; ++w)
+    {
+        uint64_t value = src[w + k] >> s;
+        if (s != 0 && w + k + 1 < words)
+            value |= src[w + k + 1] << (64 - s);
+        dst[w] |= value;
+    }
+}
+
+//Finds the topmost, then leftmost spot where none of the visible cells of mask land on a taken cell
+static bool FindMaskSpot(const CellMap& taken, const AlphaMask& mask, int& bestX, int& bestY)
+{
+    if (mask.width > taken.cols || mask.height > taken.rows)
+        return false;
+    
+    //Bit x of blocked gets set when putting the mask at x would make it overlap something. A run of cells
+    //from a to b in the mask blocks x wherever any of the cells from x + a to x + b - 1 are taken, which is
+    //the row smeared over b - a cells and shifted down by a.
+    int span = taken.cols - mask.width + 1;
+    vector<uint64_t> blocked(taken.words);
+    vector<uint64_t> smeared(taken.words);
+    vector<int> longest(mask.height, 0);
+    int shortest = taken.cols;
+    bool solid = true;
+    for (int r = 0; r < mask.height; ++r)
+    {
+        for (auto& run : mask.runs[r])
+            longest[r] = max(longest[r], run.second - run.first);
+        shortest = min(shortest, longest[r]);
+        solid = solid && longest[r] > 0;
+    }
+    for (int y = 0; y + mask.height <= taken.rows; ++y)
+    {
+        //Rule out the spots where a row of the mask is longer than any free run in the row it lands on. When
+        //that row has no room for even the shortest row of the mask, and every row of the mask has something
+        //in it, the mask has to go below it.
+        bool full = false;
+        for (int r = mask.height; r-- > 0;)
+        {
+            if (longest[r] > taken.longestFree[y + r])
+            {
+                if (solid && taken.longestFree[y + r] < shortest)
+                    y += r;
+                full = true;
+                break;
+            }
+        }
+        if (full)
+            continue;
+        
+        fill(blocked.begin(), blocked.end(), 0);
+        for (int r = 0; r < mask.height && !full; ++r)
+        {
+            if (mask.runs[r].empty())
+                continue;
+            const uint64_t* row = &taken.bits[(y + r) * taken.words];
+            for (auto& run : mask.runs[r])
+            {
+                copy(row, row + taken.words, smeared.begin());
+                for (int done = 1, length = run.second - run.first; done < length; done *= 2)
+                    OrShiftedDown(smeared.data(), smeared.data(), taken.words, min(done, length - done));
+                OrShiftedDown(blocked.data(), smeared.data(), taken.words, run.first);
+            }
+            full = CellMap::IsFull(blocked.data(), span);
+        }
+        if (full)
+            continue;
+        for (int x = 0; x < span; ++x)
+        {
+            if ((blocked[x / 64] >> (x % 64) & 1) == 0)
+            {
+                bestX = x;
+                bestY = y;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+//Packs the bitmaps by their alpha masks instead of their bounding boxes, so that the transparent corners of one
+//can hold parts of another. Each bitmap goes in the topmost, then leftmost spot its mask fits, on a grid of
+//method.dense pixel cells, and keeps the cells within the padding of its visible pixels clear.
+void Packer::PackDense(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rotate, const PackMethod& method)
+{
+    int cell = method.dense;
+    CellMap taken(width / cell, height / cell);
+    
+    //The bitmaps that were kept in place take up all of their cells
+    int ww = 0;
+    int hh = 0;
+    for (size_t i = 0; i < points.size(); ++i)
+    {
+        const Point& p = points[i];
+        if (p.dupID >= 0)
+            continue;
+        int w = GetCellSize(p.rot ? this->bitmaps[i]->height : this->bitmaps[i]->width);
+        int h = GetCellSize(p.rot ? this->bitmaps[i]->width : this->bitmaps[i]->height);
+        taken.Fill(p.x / cell, (p.x + w + cell - 1) / cell, p.y / cell, (p.y + h + cell - 1) / cell);
+        ww = max(p.x + w, ww);
+        hh = max(p.y + h, hh);
+    }
+    
+    vector<Bitmap*> skipped;
+    while (!bitmaps.empty())
+    {
+        auto bitmap = bitmaps.back();
+        
+        if (verbose)
+            cout << '\t' << bitmaps.size() << ": " << bitmap->name << endl;
+        
+        //Check to see if this is a duplicate of an already packed bitmap
+        if (unique)
+        {
+            int dupID = FindDuplicate(bitmap);
+            if (dupID >= 0)
+            {
+                Point p = points[dupID];
+                p.dupID = dupID;
+                points.push_back(p);
+                this->bitmaps.push_back(bitmap);
+                bitmaps.pop_back();
+                continue;
+            }
+        }
+        
+        //Try it both ways round, keeping whichever reaches down the least
+        const AlphaMask& mask = GetCachedAlphaMask(bitmap, false, cell, 0);
+        int x = 0;
+        int y = 0;
+        bool found = FindMaskSpot(taken, mask, x, y);
+        bool rot = false;
+        if (rotate && bitmap->width != bitmap->height)
+        {
+            const AlphaMask& rotMask = GetCachedAlphaMask(bitmap, true, cell, 0);
+            int rx = 0;
+            int ry = 0;
+            if (FindMaskSpot(taken, rotMask, rx, ry) && (!found || ry + rotMask.height < y + mask.height || (ry + rotMask.height == y + mask.height && rx < x)))
+            {
+                found = true;
+                rot = true;
+                x = rx;
+                y = ry;
+            }
+        }
+        
+        if (!found)
+        {
+            if (!method.fill)
+                break;
+            skipped.push_back(bitmap);
+            bitmaps.pop_back();
+            continue;
+        }
+        
+        //The bitmaps after it have to keep their visible pixels out of its padding
+        taken.Fill(GetCachedAlphaMask(bitmap, rot, cell, pad), x, y);
+        
+        if (unique)
+            dupLookup[bitmap->hashValue] = static_cast<int>(points.size());
+        
+        Point p;
+        p.x = x * cell;
+        p.y = y * cell;
+        p.dupID = -1;
+        p.rot = rot;
+        points.push_back(p);
+        this->bitmaps.push_back(bitmap);
+        bitmaps.pop_back();
+        
+        ww = max(p.x + (rot ? bitmap->height : bitmap->width), ww);
+        hh = max(p.y + (rot ? bitmap->width : bitmap->height), hh);
+    }
+    
+    //Whatever was set aside goes back for the next atlas, still in sorted order
+    bitmaps.insert(bitmaps.end(), skipped.rbegin(), skipped.rend());
+    
+    //Nothing fit, so there's nothing to shrink down to
+    if (this->bitmaps.empty())
+        return;
+    
+    while (width / 2 >= ww)
+        width /= 2;
+    while (height / 2 >= hh)
+        height /= 2;
+}
+
+int Packer::FindDuplicate(Bitmap* bitmap) const
+{
+    auto di = dupLookup.find(bitmap->hashValue);
+    if (di != dupLookup.end() && bitmap->Equals(bitmaps[di->second]))
+        return di->second;
+    return -1;
+}
+
+//Copies the packed bitmaps into a bitmap, with the atlas's top left corner at x, y. When the bitmaps are aligned,
+//the edge pixels get extruded to the end of their cells, so that block compression doesn't mix in the neighbours.
+//Anything outside of the bitmap is clipped, so it can be just one band of the atlas.
+void Packer::Draw(Bitmap& bitmap, int x, int y, bool masked)
 {
-    Bitmap bitmap(width, height);
     for (size_t i = 0, j = bitmaps.size(); i < j; ++i)
     {
         if (points[i].dupID < 0)
         {
-            if (points[i].rot)
-                bitmap.CopyPixelsRot(bitmaps[i], points[i].x, points[i].y);
+            int w = points[i].rot ? bitmaps[i]->height : bitmaps[i]->width;
+            int h = points[i].rot ? bitmaps[i]->width : bitmaps[i]->height;
+            int cellW = align > 1 ? GetCellSize(w) : w;
+            int cellH = align > 1 ? GetCellSize(h) : h;
+            if (masked)
+                bitmap.CopyVisible(bitmaps[i], x + points[i].x, y + points[i].y, points[i].rot);
             else
-                bitmap.CopyPixels(bitmaps[i], points[i].x, points[i].y);
+                bitmap.CopyCell(bitmaps[i], x + points[i].x, y + points[i].y, points[i].rot, cellW, cellH);
         }
     }
-    bitmap.SaveAs(file);
 }
 
-void Packer::SaveXml(const string& name, ofstream& xml, bool trim, bool rotate)
+void Packer::SavePng(const string& file, bool masked)
+{
+    ::SavePng(file, vector<Packer*>(1, this), masked);
+}
+
+//Images with more pixels than this are drawn and encoded a band of rows at a time, instead of all at once
+static const int64_t MaxPngArea = 4096 * 4096;
+static const int BandArea = 1 << 22;
+
+void SavePng(const string& file, const vector<Packer*>& packers, bool masked)
+{
+    int width = packers[0]->width;
+    int layerHeight = packers[0]->height;
+    int height = layerHeight * static_cast<int>(packers.size());
+    if (static_cast<int64_t>(width) * height <= MaxPngArea)
+    {
+        Bitmap bitmap(width, height);
+        for (size_t i = 0; i < packers.size(); ++i)
+            packers[i]->Draw(bitmap, 0, layerHeight * static_cast<int>(i), masked);
+        bitmap.SaveAs(file);
+        return;
+    }
+    
+    PngWriter png(file, width, height);
+    int bandHeight = max(1, BandArea / width);
+    for (int y = 0; y < height; y += bandHeight)
+    {
+        Bitmap band(width, min(bandHeight, height - y));
+        for (size_t i = 0; i < packers.size(); ++i)
+        {
+            int top = layerHeight * static_cast<int>(i);
+            if (top < y + band.height && top + layerHeight > y)
+                packers[i]->Draw(band, 0, top - y, masked);
+        }
+        png.Write(band);
+    }
+}
+
+void Packer::SaveXml(const string& name, ofstream& xml, bool trim, bool rotate, int layer)
 {
     xml << "\t<tex n=\"" << name << "\">" << endl;
     for (size_t i = 0, j = bitmaps.size(); i < j; ++i)
@@ -135,35 +1082,39 @@ void Packer::SaveXml(const string& name, ofstream& xml, bool trim, bool rotate)
         }
         if (rotate)
             xml << "r=\"" << (points[i].rot ? 1 : 0) << "\" ";
+        if (layer >= 0)
+            xml << "l=\"" << layer << "\" ";
         xml << "/>" << endl;
     }
     xml << "\t</tex>" << endl;
 }
 
-void Packer::SaveBin(const string& name, ofstream& bin, bool trim, bool rotate)
+void Packer::SaveBin(const string& name, ofstream& bin, bool trim, bool rotate, int layer)
 {
     WriteString(bin, name);
-    WriteShort(bin, (int16_t)bitmaps.size());
+    WriteInt(bin, static_cast<int>(bitmaps.size()));
     for (size_t i = 0, j = bitmaps.size(); i < j; ++i)
     {
         WriteString(bin, bitmaps[i]->name);
-        WriteShort(bin, (int16_t)points[i].x);
-        WriteShort(bin, (int16_t)points[i].y);
-        WriteShort(bin, (int16_t)bitmaps[i]->width);
-        WriteShort(bin, (int16_t)bitmaps[i]->height);
+        WriteInt(bin, points[i].x);
+        WriteInt(bin, points[i].y);
+        WriteInt(bin, bitmaps[i]->width);
+        WriteInt(bin, bitmaps[i]->height);
         if (trim)
         {
-            WriteShort(bin, (int16_t)bitmaps[i]->frameX);
-            WriteShort(bin, (int16_t)bitmaps[i]->frameY);
-            WriteShort(bin, (int16_t)bitmaps[i]->frameW);
-            WriteShort(bin, (int16_t)bitmaps[i]->frameH);
+            WriteInt(bin, bitmaps[i]->frameX);
+            WriteInt(bin, bitmaps[i]->frameY);
+            WriteInt(bin, bitmaps[i]->frameW);
+            WriteInt(bin, bitmaps[i]->frameH);
         }
         if (rotate)
             WriteByte(bin, points[i].rot ? 1 : 0);
+        if (layer >= 0)
+            WriteInt(bin, layer);
     }
 }
 
-void Packer::SaveJson(const string& name, ofstream& json, bool trim, bool rotate)
+void Packer::SaveJson(const string& name, ofstream& json, bool trim, bool rotate, int layer)
 {
     json << "\t\t\t\"name\":\"" << name << "\"," << endl;
     json << "\t\t\t\"images\":[" << endl;
@@ -184,6 +1135,8 @@ void Packer::SaveJson(const string& name, ofstream& json, bool trim, bool rotate
         }
         if (rotate)
             json << ", \"r\":" << (points[i].rot ? "true" : "false");
+        if (layer >= 0)
+            json << ", \"l\":" << layer;
         json << " }";
         if(i != bitmaps.size() -1)
             json << ",";
@@ -191,3 +1144,88 @@ void Packer::SaveJson(const string& name, ofstream& json, bool trim, bool rotate
     }
     json << "\t\t\t]" << endl;
 }
+
+bool LoadBin(const string& file, bool trim, bool rotate, bool layers, vector<vector<Placement>>& atlases)
+{
+    ifstream bin(file, ios::binary);
+    if (!bin)
+        return false;
+    
+    atlases.clear();
+    int numTextures = ReadInt(bin);
+    for (int i = 0; i < numTextures && bin; ++i)
+    {
+        ReadString(bin);
+        atlases.emplace_back();
+        int numImages = ReadInt(bin);
+        for (int j = 0; j < numImages && bin; ++j)
+        {
+            Placement placement;
+            placement.name = ReadString(bin);
+            placement.x = ReadInt(bin);
+            placement.y = ReadInt(bin);
+            placement.width = ReadInt(bin);
+            placement.height = ReadInt(bin);
+            if (trim)
+            {
+                for (int k = 0; k < 4; ++k)
+                    ReadInt(bin);
+            }
+            placement.rot = rotate && ReadByte(bin) != 0;
+            if (layers)
+                ReadInt(bin);
+            atlases.back().push_back(placement);
+        }
+    }
+    return static_cast<bool>(bin);
+}
+
+//Finds "key": in a line of json and reads the value after it
+static bool ReadJsonValue(const string& line, const string& key, string& value)
+{
+    size_t start = line.find("\"" + key + "\":");
+    if (start == string::npos)
+        return false;
+    start += key.size() + 3;
+    if (start < line.size() && line[start] == '"')
+    {
+        size_t end = line.find('"', start + 1);
+        if (end == string::npos)
+            return false;
+        value = line.substr(start + 1, end - start - 1);
+        return true;
+    }
+    size_t end = line.find_first_of(", }", start);
+    value = line.substr(start, end == string::npos ? string::npos : end - start);
+    return true;
+}
+
+bool LoadJson(const string& file, vector<vector<Placement>>& atlases)
+{
+    ifstream json(file);
+    if (!json)
+        return false;
+    
+    //Reads the layout SaveJson writes: an atlas name on a line of its own, then one line per image
+    atlases.clear();
+    string line;
+    while (getline(json, line))
+    {
+        Placement placement;
+        string x, y, w, h, r;
+        if (ReadJsonValue(line, "n", placement.name))
+        {
+            if (atlases.empty() || !ReadJsonValue(line, "x", x) || !ReadJsonValue(line, "y", y) || !ReadJsonValue(line, "w", w) || !ReadJsonValue(line, "h", h))
+                return false;
+            placement.x = atoi(x.c_str());
+            placement.y = atoi(y.c_str());
+            placement.width = atoi(w.c_str());
+            placement.height = atoi(h.c_str());
+            placement.rot = ReadJsonValue(line, "r", r) && r == "true";
+            atlases.back().push_back(placement);
+        }
+        else if (ReadJsonValue(line, "name", placement.name))
+            atlases.emplace_back();
+    }
+    return true;
+}
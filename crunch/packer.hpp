@@ -30,7 +30,11 @@
 #include <vector>
 #include <fstream>
 #include <unordered_map>
+#include <functional>
 #include "bitmap.hpp"
+#include "MaxRectsBinPack.h"
+#include "GuillotineBinPack.h"
+#include "SkylineBinPack.h"
 
 using namespace std;
 
@@ -42,22 +46,107 @@ struct Point
     bool rot;
 };
 
+enum class Algorithm
+{
+    MaxRects,
+    Guillotine,
+    Skyline
+};
+
+enum class SortOrder
+{
+    Area,
+    MaxSide,
+    Width,
+    Height,
+    Perimeter
+};
+
+struct PackMethod
+{
+    Algorithm algorithm;
+    SortOrder sort;
+    rbp::MaxRectsBinPack::FreeRectChoiceHeuristic heuristic;
+    rbp::GuillotineBinPack::FreeRectChoiceHeuristic guillotineChoice;
+    rbp::GuillotineBinPack::GuillotineSplitHeuristic guillotineSplit;
+    bool merge;
+    rbp::SkylineBinPack::LevelChoiceHeuristic skylineLevel;
+    bool wasteMap;
+    bool batch;
+    bool grid;
+    bool fill;
+    
+    //The size of the cells the bitmaps' alpha masks are packed on, or 0 to pack their bounding boxes
+    int dense;
+    
+    //Bitmaps that --optimize-ms turned on their side, sorted. When rotating, the packer puts these in sideways instead
+    //of letting the heuristic pick. Only the one at a time packer looks at them, not the batch or dense ones.
+    vector<const Bitmap*> sideways;
+    
+    PackMethod();
+    
+    //Reads the algorithm and its heuristics from a string like "maxrects-baf", "guillotine-bssf-slas-merge" or "skyline-bl-wastemap"
+    bool ParseAlgorithm(const string& str);
+    string AlgorithmToString() const;
+    
+    //Reads the sort order from a string like "area" or "max-side"
+    bool ParseSort(const string& str);
+    string SortToString() const;
+    string ToString() const;
+};
+
+//Where an earlier build put a bitmap, as read back from its .bin or .json file
+struct Placement
+{
+    string name;
+    int x;
+    int y;
+    int width;
+    int height;
+    bool rot;
+};
+
+//Read back the placements of an earlier build, one list per atlas. Return false if the file is missing or broken.
+bool LoadBin(const string& file, bool trim, bool rotate, bool layers, vector<vector<Placement>>& atlases);
+bool LoadJson(const string& file, vector<vector<Placement>>& atlases);
+
+//The room a side of a bitmap takes up in an atlas: its length plus the padding, rounded up to a multiple of align
+int GetCellSize(int size, int pad, int align);
+
+//Sorts the bitmaps from smallest to largest, so that the packer (which takes them from the back) starts with the largest.
+//Bitmaps that are the same size are sorted by name.
+void SortBitmaps(vector<Bitmap*>& bitmaps, SortOrder sort);
+
 struct Packer
 {
     int width;
     int height;
     int pad;
+    int align;
     
     vector<Bitmap*> bitmaps;
     vector<Point> points;
     unordered_map<size_t, int> dupLookup;
     
-    Packer(int width, int height, int pad);
-    void Pack(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rotate);
-    void SavePng(const string& file);
-    void SaveXml(const string& name, ofstream& xml, bool trim, bool rotate);
-    void SaveBin(const string& name, ofstream& bin, bool trim, bool rotate);
-    void SaveJson(const string& name, ofstream& json, bool trim, bool rotate);
+    Packer(int width, int height, int pad, int align);
+    int GetCellSize(int size) const;
+    bool Keep(Bitmap* bitmap, int x, int y, bool rot, bool unique);
+    void Pack(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rotate, const PackMethod& method);
+    void PackGrids(vector<Bitmap*>& bitmaps, bool verbose, bool unique, const function<rbp::Rect(int, int, bool)>& insert, int& ww, int& hh);
+    void PackDense(vector<Bitmap*>& bitmaps, bool verbose, bool unique, bool rotate, const PackMethod& method);
+    int FindDuplicate(Bitmap* bitmap) const;
+    
+    //When masked, only the visible pixels of each bitmap get drawn, since densely packed bitmaps can overlap
+    void Draw(Bitmap& bitmap, int x, int y, bool masked);
+    void SavePng(const string& file, bool masked);
+    
+    //A layer of -1 leaves the layer index out of each image's entry
+    void SaveXml(const string& name, ofstream& xml, bool trim, bool rotate, int layer);
+    void SaveBin(const string& name, ofstream& bin, bool trim, bool rotate, int layer);
+    void SaveJson(const string& name, ofstream& json, bool trim, bool rotate, int layer);
 };
 
+//Saves the atlases stacked on top of each other as one png. They all have to be the same size.
+void SavePng(const string& file, const vector<Packer*>& packers, bool masked);
+
 #endif
@@ -0,0 +1,62 @@
+/*
+ 
+ MIT License
+ 
+ Copyright (c) 2017 Chevy Ray Johnston
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ 
+ */
+
+#include "parallel.hpp"
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+//Set while a thread runs the tasks of a ParallelFor. The cores are all busy by then, so a ParallelFor called from
+//one of those tasks runs serially instead of starting threads of its own.
+static thread_local bool inParallelFor = false;
+
+void ParallelFor(size_t count, const function<void(size_t)>& task)
+{
+    size_t numThreads = min(static_cast<size_t>(max(thread::hardware_concurrency(), 1u)), count);
+    if (numThreads <= 1 || inParallelFor)
+    {
+        for (size_t i = 0; i < count; ++i)
+            task(i);
+        return;
+    }
+    
+    //Each thread grabs the next index until there are none left, so uneven tasks still share the work evenly
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        inParallelFor = true;
+        for (size_t i = next++; i < count; i = next++)
+            task(i);
+        inParallelFor = false;
+    };
+    
+    vector<thread> threads;
+    for (size_t i = 1; i < numThreads; ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads)
+        t.join();
+}
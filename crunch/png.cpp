@@ -0,0 +1,199 @@
+/*
+ 
+ MIT License
+ 
+ Copyright (c) 2017 Chevy Ray Johnston
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ 
+ */
+
+#include "png.hpp"
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "lodepng.h"
+
+static void PushInt(vector<unsigned char>& data, uint32_t value)
+{
+    data.push_back(static_cast<unsigned char>(value >> 24));
+    data.push_back(static_cast<unsigned char>(value >> 16));
+    data.push_back(static_cast<unsigned char>(value >> 8));
+    data.push_back(static_cast<unsigned char>(value));
+}
+
+static unsigned char Paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return static_cast<unsigned char>(a);
+    return static_cast<unsigned char>(pb <= pc ? b : c);
+}
+
+//Filters a row with the given png filter type, from the row above it in prev
+static void FilterRow(unsigned char* out, const unsigned char* row, const unsigned char* prev, size_t size, int type)
+{
+    size_t first = min(size, static_cast<size_t>(4));
+    switch (type)
+    {
+        case 0:
+            memcpy(out, row, size);
+            break;
+        case 1:
+            memcpy(out, row, first);
+            for (size_t i = first; i < size; ++i)
+                out[i] = static_cast<unsigned char>(row[i] - row[i - 4]);
+            break;
+        case 2:
+            for (size_t i = 0; i < size; ++i)
+                out[i] = static_cast<unsigned char>(row[i] - prev[i]);
+            break;
+        case 3:
+            for (size_t i = 0; i < first; ++i)
+                out[i] = static_cast<unsigned char>(row[i] - (prev[i] >> 1));
+            for (size_t i = first; i < size; ++i)
+                out[i] = static_cast<unsigned char>(row[i] - ((row[i - 4] + prev[i]) >> 1));
+            break;
+        default:
+            for (size_t i = 0; i < first; ++i)
+                out[i] = static_cast<unsigned char>(row[i] - prev[i]);
+            for (size_t i = first; i < size; ++i)
+                out[i] = static_cast<unsigned char>(row[i] - Paeth(row[i - 4], prev[i], prev[i - 4]));
+            break;
+    }
+}
+
+PngWriter::PngWriter(const string& file, int width, int height)
+: file(file), png(file, ios::binary), width(width), height(height), rowsWritten(0), prevRow(width * 4, 0),
+  deflated(nullptr), deflatedSize(0), bitPointer(0), adler(1)
+{
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    png.write(reinterpret_cast<const char*>(signature), 8);
+    
+    vector<unsigned char> header;
+    PushInt(header, static_cast<uint32_t>(width));
+    PushInt(header, static_cast<uint32_t>(height));
+    header.push_back(8); //bit depth
+    header.push_back(6); //RGBA
+    header.push_back(0); //compression
+    header.push_back(0); //filter
+    header.push_back(0); //interlace
+    WriteChunk("IHDR", header);
+}
+
+PngWriter::~PngWriter()
+{
+    free(deflated);
+}
+
+void PngWriter::Write(const Bitmap& band)
+{
+    //Filter each row the way that leaves the smallest sum of signed bytes, like lodepng does
+    size_t rowSize = prevRow.size();
+    filtered.resize(band.height * (rowSize + 1));
+    vector<unsigned char> attempt(rowSize);
+    for (int y = 0; y < band.height; ++y)
+    {
+        const unsigned char* row = reinterpret_cast<const unsigned char*>(band.data + y * width);
+        unsigned char* out = filtered.data() + y * (rowSize + 1);
+        size_t bestSum = SIZE_MAX;
+        for (int type = 0; type < 5; ++type)
+        {
+            FilterRow(attempt.data(), row, prevRow.data(), rowSize, type);
+            size_t sum = 0;
+            for (size_t i = 0; i < rowSize; ++i)
+                sum += attempt[i] < 128 ? attempt[i] : 256 - attempt[i];
+            if (sum < bestSum)
+            {
+                bestSum = sum;
+                out[0] = static_cast<unsigned char>(type);
+                memcpy(out + 1, attempt.data(), rowSize);
+            }
+        }
+        memcpy(prevRow.data(), row, rowSize);
+    }
+    
+    //Keep the zlib checksum of the whole stream going
+    uint32_t s1 = adler & 0xffff;
+    uint32_t s2 = adler >> 16;
+    for (size_t i = 0; i < filtered.size(); )
+    {
+        size_t end = min(filtered.size(), i + 5552);
+        for (; i < end; ++i)
+        {
+            s1 += filtered[i];
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+    }
+    adler = (s2 << 16) | s1;
+    
+    bool first = rowsWritten == 0;
+    rowsWritten += band.height;
+    bool final = rowsWritten >= height;
+    vector<unsigned char> data;
+    if (first)
+    {
+        data.push_back(120); //zlib header: deflate with a 32k window
+        data.push_back(1);
+    }
+    if (lodepng_deflate_part(&deflated, &deflatedSize, &bitPointer, filtered.data(), filtered.size(), final ? 1 : 0, &lodepng_default_compress_settings))
+        Fail();
+    
+    //Only whole bytes can go out, the last partial one stays behind for the next band to finish
+    size_t done = final ? deflatedSize : bitPointer / 8;
+    data.insert(data.end(), deflated, deflated + done);
+    memmove(deflated, deflated + done, deflatedSize - done);
+    deflatedSize -= done;
+    bitPointer -= done * 8;
+    if (final)
+        PushInt(data, adler);
+    if (!data.empty())
+        WriteChunk("IDAT", data);
+    if (final)
+    {
+        WriteChunk("IEND", vector<unsigned char>());
+        png.close();
+        if (!png)
+            Fail();
+    }
+}
+
+void PngWriter::WriteChunk(const char* type, const vector<unsigned char>& data)
+{
+    vector<unsigned char> chunk;
+    PushInt(chunk, static_cast<uint32_t>(data.size()));
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    PushInt(chunk, lodepng_crc32(chunk.data() + 4, chunk.size() - 4));
+    png.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+    if (!png)
+        Fail();
+}
+
+void PngWriter::Fail()
+{
+    cerr << "failed to save png: " << file << endl;
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,63 @@
+/*
+ 
+ MIT License
+ 
+ Copyright (c) 2017 Chevy Ray Johnston
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ 
+ */
+
+#ifndef png_hpp
+#define png_hpp
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <cstdint>
+#include "bitmap.hpp"
+
+using namespace std;
+
+//Writes a png a band of rows at a time, so that a huge image never has to be held in memory all at once.
+//The pixels are saved as 8-bit RGBA, with one deflate stream running through all the bands.
+struct PngWriter
+{
+    string file;
+    ofstream png;
+    int width;
+    int height;
+    int rowsWritten;
+    vector<unsigned char> prevRow;
+    vector<unsigned char> filtered;
+    unsigned char* deflated;
+    size_t deflatedSize;
+    size_t bitPointer;
+    uint32_t adler;
+    
+    PngWriter(const string& file, int width, int height);
+    ~PngWriter();
+    
+    //Appends the rows of band, which has to be as wide as the image. The image is done once all its rows are in.
+    void Write(const Bitmap& band);
+    void WriteChunk(const char* type, const vector<unsigned char>& data);
+    void Fail();
+};
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ 
+ MIT License
+ 
+ Copyright (c) 2017 Chevy Ray Johnston
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ 
+ */
+
+#include "validate.hpp"
+#include <iostream>
+#include <algorithm>
+#include <set>
+#include <queue>
+#include <functional>
+
+using namespace std;
+
+namespace
+{
+    //The area of the atlas an image keeps to itself, from left to right and top to bottom
+    struct Cell
+    {
+        int left;
+        int top;
+        int right;
+        int bottom;
+    };
+    
+    enum class Clash
+    {
+        None,
+        Padding,
+        Overlap
+    };
+}
+
+//Cells go in one bucket per power of two of their height, so no bucket holds cells more than twice as tall as another
+static size_t GetHeightBucket(const Cell& cell)
+{
+    size_t bucket = 0;
+    for (int height = cell.bottom - cell.top; height > 1; height >>= 1)
+        ++bucket;
+    return bucket;
+}
+
+static bool IsVisible(const Bitmap* bitmap, bool rot, int x, int y)
+{
+    uint32_t pixel = rot ? bitmap->data[(bitmap->height - 1 - x) * bitmap->width + y] : bitmap->data[y * bitmap->width + x];
+    return (pixel >> 24) != 0;
+}
+
+//Checks whether a visible pixel of b lies on one of a, or within pad pixels of one
+static Clash ComparePixels(const Placement& a, const Bitmap* bitmapA, const Placement& b, const Bitmap* bitmapB, int pad)
+{
+    int aw = a.rot ? a.height : a.width;
+    int ah = a.rot ? a.width : a.height;
+    int bw = b.rot ? b.height : b.width;
+    int bh = b.rot ? b.width : b.height;
+    int x0 = max(a.x - pad, b.x);
+    int y0 = max(a.y - pad, b.y);
+    int x1 = min(a.x + aw + pad, b.x + bw);
+    int y1 = min(a.y + ah + pad, b.y + bh);
+    if (x0 >= x1 || y0 >= y1)
+        return Clash::None;
+    
+    //How many pixels of a are visible above and to the left of each spot, so the area around a pixel of b can be
+    //checked at once
+    int stride = aw + 1;
+    vector<int> counts(stride * (ah + 1), 0);
+    for (int y = 0; y < ah; ++y)
+        for (int x = 0; x < aw; ++x)
+            counts[(y + 1) * stride + x + 1] = (IsVisible(bitmapA, a.rot, x, y) ? 1 : 0) + counts[y * stride + x + 1] + counts[(y + 1) * stride + x] - counts[y * stride + x];
+    
+    Clash clash = Clash::None;
+    for (int y = y0; y < y1; ++y)
+    {
+        for (int x = x0; x < x1; ++x)
+        {
+            if (!IsVisible(bitmapB, b.rot, x - b.x, y - b.y))
+                continue;
+            int ax = x - a.x;
+            int ay = y - a.y;
+            if (ax >= 0 && ay >= 0 && ax < aw && ay < ah && IsVisible(bitmapA, a.rot, ax, ay))
+                return Clash::Overlap;
+            int left = max(ax - pad, 0);
+            int top = max(ay - pad, 0);
+            int right = min(ax + pad + 1, aw);
+            int bottom = min(ay + pad + 1, ah);
+            if (left < right && top < bottom && counts[bottom * stride + right] - counts[top * stride + right] - counts[bottom * stride + left] + counts[top * stride + left] > 0)
+                clash = Clash::Padding;
+        }
+    }
+    return clash;
+}
+
+//Reports a clash between two images whose cells meet, and returns how many problems it found
+static int CompareCells(const string& name, const Placement& a, const Placement& b, const Bitmap* bitmapA, const Bitmap* bitmapB, int pad)
+{
+    Clash clash;
+    if (bitmapA != nullptr && bitmapB != nullptr)
+        clash = ComparePixels(a, bitmapA, b, bitmapB, pad);
+    else
+    {
+        int aw = a.rot ? a.height : a.width;
+        int ah = a.rot ? a.width : a.height;
+        int bw = b.rot ? b.height : b.width;
+        int bh = b.rot ? b.width : b.height;
+        bool overlap = a.x < b.x + bw && b.x < a.x + aw && a.y < b.y + bh && b.y < a.y + ah;
+        clash = overlap ? Clash::Overlap : Clash::Padding;
+    }
+    if (clash == Clash::Overlap)
+        cerr << name << ": " << a.name << " overlaps " << b.name << endl;
+    else if (clash == Clash::Padding)
+        cerr << name << ": " << a.name << " is too close to " << b.name << endl;
+    return clash != Clash::None ? 1 : 0;
+}
+
+int ValidateAtlas(const string& name, int width, int height, int pad, int align, const vector<Placement>& placements, const vector<const Bitmap*>& bitmaps)
+{
+    int problems = 0;
+    vector<Cell> cells;
+    vector<size_t> order;
+    cells.reserve(placements.size());
+    for (size_t i = 0; i < placements.size(); ++i)
+    {
+        const Placement& placement = placements[i];
+        int w = placement.rot ? placement.height : placement.width;
+        int h = placement.rot ? placement.width : placement.height;
+        if (placement.x < 0 || placement.y < 0 || placement.x + w > width || placement.y + h > height)
+        {
+            cerr << name << ": " << placement.name << " is outside the atlas (" << width << " x " << height << ')' << endl;
+            ++problems;
+        }
+        
+        //Densely packed images only keep their visible pixels apart, so their cells are just their rectangles
+        //grown by the padding, and the ones that touch get compared pixel by pixel
+        if (bitmaps.empty())
+            cells.push_back({ placement.x, placement.y, placement.x + GetCellSize(w, pad, align), placement.y + GetCellSize(h, pad, align) });
+        else
+            cells.push_back({ placement.x, placement.y, placement.x + w + pad, placement.y + h + pad });
+        order.push_back(i);
+    }
+    
+    //Sweep from left to right over the cells, keeping the ones the sweep line crosses bucketed by height and sorted
+    //from top to bottom
+    sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return cells[a].left < cells[b].left;
+    });
+    vector<set<pair<int, size_t>>> active;
+    vector<int> tallest;
+    priority_queue<pair<int, size_t>, vector<pair<int, size_t>>, greater<pair<int, size_t>>> leaving;
+    for (size_t i : order)
+    {
+        const Cell& cell = cells[i];
+        while (!leaving.empty() && leaving.top().first <= cell.left)
+        {
+            const Cell& passed = cells[leaving.top().second];
+            active[GetHeightBucket(passed)].erase(make_pair(passed.top, leaving.top().second));
+            leaving.pop();
+        }
+        
+        //Cells may overlap each other, as densely packed ones do, so any active cell that starts above this one's
+        //bottom, and no further up than the tallest cell in its bucket, can reach it. Cells in a bucket are at least
+        //half as tall as that, so few of the ones that start too far up to reach get looked at
+        for (size_t k = 0; k < active.size(); ++k)
+        {
+            auto it = active[k].lower_bound(make_pair(cell.top - tallest[k] + 1, size_t(0)));
+            for (; it != active[k].end() && it->first < cell.bottom; ++it)
+            {
+                size_t j = it->second;
+                if (cells[j].bottom <= cell.top)
+                    continue;
+                
+                problems += CompareCells(name, placements[j], placements[i], bitmaps.empty() ? nullptr : bitmaps[j], bitmaps.empty() ? nullptr : bitmaps[i], pad);
+            }
+        }
+        size_t bucket = GetHeightBucket(cell);
+        if (bucket >= active.size())
+        {
+            active.resize(bucket + 1);
+            tallest.resize(bucket + 1, 0);
+        }
+        active[bucket].insert(make_pair(cell.top, i));
+        tallest[bucket] = max(tallest[bucket], cell.bottom - cell.top);
+        leaving.push(make_pair(cell.right, i));
+    }
+    return problems;
+}
+
@@ -0,0 +1,45 @@
+/*
+ 
+ MIT License
+ 
+ Copyright (c) 2017 Chevy Ray Johnston
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ 
+ */
+
+#ifndef validate_hpp
+#define validate_hpp
+
+#include <string>
+#include <vector>
+#include "bitmap.hpp"
+#include "packer.hpp"
+
+using namespace std;
+
+//Checks that every image of an atlas lies inside it, and that no two images overlap or come closer than the padding
+//allows, sweeping across the atlas so only images that are near each other get compared. Each image keeps its cell
+//to itself: the area GetCellSize gives it, to its right and below. If bitmaps is given (one per placement, in the
+//same order), images are compared by their visible pixels instead, as --dense packs them, and only have to keep pad
+//pixels apart.
+//Prints each problem it finds and returns how many there were.
+int ValidateAtlas(const string& name, int width, int height, int pad, int align, const vector<Placement>& placements, const vector<const Bitmap*>& bitmaps);
+
+#endif